@@ -0,0 +1,109 @@
+/* games: play recorded sessions of the shipped games to their end and
+ * report what each took. Every pair of arguments names an image and a key
+ * file, whose keys it reads the way lc3_vm -i does:
+ *
+ *     bench/games -c jit test/2048.obj test/2048.keys test/rogue.obj test/rogue.keys
+ *
+ * The key files play the game until it HALTs (2048 loses 20 games and
+ * declines another, rogue clears 30 dungeons and quits). They are raw keys
+ * rather than lc3_vm -e logs on purpose: the VM reads the file itself, a key
+ * is always ready, so every run executes the same instructions, and the
+ * keys still go through the input ring and KBSR/GETC paths a replay would
+ * skip. They are also what make check plays. Output goes to /dev/null
+ * through the usual buffer. The reads, writes and waits reported are the
+ * VM's own input reads, output writes and idle waits, not every system call
+ * of the process.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lc3_vm.h"
+
+/* far beyond either session, a run that reaches it went wrong */
+enum { GAME_LIMIT = 2000000000 };
+
+/* the guest's files stay open until it is destroyed, which flushes its output */
+static void finish(struct lc3_vm *vm)
+{
+    int input_fd = vm->input.fd;
+    int output_fd = vm->output.fd;
+    lc3_vm_destroy(vm);
+    if (input_fd >= 0)
+        close(input_fd);
+    if (output_fd >= 0)
+        close(output_fd);
+}
+
+static bool play(const char *core, const char *image, const char *keys)
+{
+    struct lc3_vm *vm = lc3_vm_create();
+    if (vm == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return false;
+    }
+    vm->input.fd = -1;
+    vm->output.fd = -1;
+    if (core && !lc3_vm_set_core(vm, core))
+    {
+        fprintf(stderr, "unknown core: %s\n", core);
+        finish(vm);
+        return false;
+    }
+    vm->input.fd = open(keys, O_RDONLY);
+    vm->output.fd = open("/dev/null", O_WRONLY);
+    if (vm->input.fd < 0 || vm->output.fd < 0 || !lc3_vm_load(vm, image))
+    {
+        fprintf(stderr, "cannot open %s or %s\n", image, keys);
+        finish(vm);
+        return false;
+    }
+
+    double start = lc3_now_seconds();
+    enum lc3_exit reason = lc3_vm_run(vm, GAME_LIMIT);
+    double elapsed = lc3_now_seconds() - start;
+
+    printf("%-16s %-8s %11llu instructions %8.3f s %8.2f MIPS %9llu bytes "
+           "%6llu reads %6llu writes %6llu waits%s\n",
+           image, core ? core : "default", (unsigned long long)vm->instr_count, elapsed,
+           elapsed > 0 ? vm->instr_count / elapsed / 1e6 : 0.0,
+           (unsigned long long)vm->output_stats.bytes, (unsigned long long)vm->input_stats.reads,
+           (unsigned long long)vm->output_stats.writes, (unsigned long long)vm->idle_stats.waits,
+           reason == LC3_EXIT_HALTED ? "" : ", did not finish");
+
+    finish(vm);
+    return reason == LC3_EXIT_HALTED;
+}
+
+int main(int argc, char *const argv[])
+{
+    const char *core = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            core = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c core] image keys [image keys...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind == argc || (argc - optind) % 2)
+    {
+        fprintf(stderr, "usage: %s [-c core] image keys [image keys...]\n", argv[0]);
+        return 2;
+    }
+
+    bool ok = true;
+    for (int i = optind; i < argc; i += 2)
+        ok &= play(core, argv[i], argv[i + 1]);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,246 @@
+/* kernels: write one of the synthetic benchmark images as an LC-3 object
+ * file to stdout. Each kernel stresses one path of the VM and HALTs after a
+ * fixed number of instructions:
+ *
+ *     alu       ADD/BR loop
+ *     memwalk   LDR/STR over an array
+ *     indirect  LDI/STI through a pointer
+ *     calls     JSR/RET chains three deep
+ *     puts      PUTS of a 63-character line
+ *     kbsr      KBSR/KBDR polling at the end of input
+ *
+ * There is no assembler in the tree, so the kernels are built here from the
+ * encodings. Constants and subroutines come first, behind a branch to the
+ * entry, so every label is defined before its use.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+enum { ORIGIN = 0x3000, KERNEL_MAX = 256 };
+enum { R0 = 0, R1, R2, R3, R4, R5, R6, R7 };
+enum { N = 4, Z = 2, P = 1 };
+
+static uint16_t words[KERNEL_MAX];
+static int count;
+
+static int here(void)
+{
+    return count;
+}
+
+static void emit(uint16_t word)
+{
+    if (count == KERNEL_MAX)
+    {
+        fprintf(stderr, "kernel too long\n");
+        exit(1);
+    }
+    words[count++] = word;
+}
+
+/* PC-relative offset of 'label' from the instruction being emitted */
+static uint16_t offset(int label, int bits)
+{
+    return (uint16_t)(label - (count + 1)) & ((1 << bits) - 1);
+}
+
+static void add_imm(int dr, int sr, int imm) { emit(0x1000 | dr << 9 | sr << 6 | 0x20 | (imm & 0x1F)); }
+static void add(int dr, int sr1, int sr2)    { emit(0x1000 | dr << 9 | sr1 << 6 | sr2); }
+static void br(int nzp, int label)           { emit(nzp << 9 | offset(label, 9)); }
+static void ld(int dr, int label)            { emit(0x2000 | dr << 9 | offset(label, 9)); }
+static void st(int sr, int label)            { emit(0x3000 | sr << 9 | offset(label, 9)); }
+static void jsr(int label)                   { emit(0x4800 | offset(label, 11)); }
+static void ldr(int dr, int base, int off)   { emit(0x6000 | dr << 9 | base << 6 | (off & 0x3F)); }
+static void str(int sr, int base, int off)   { emit(0x7000 | sr << 9 | base << 6 | (off & 0x3F)); }
+static void ldi(int dr, int label)           { emit(0xA000 | dr << 9 | offset(label, 9)); }
+static void sti(int sr, int label)           { emit(0xB000 | sr << 9 | offset(label, 9)); }
+static void ret(void)                        { emit(0xC1C0); }
+static void lea(int dr, int label)           { emit(0xE000 | dr << 9 | offset(label, 9)); }
+static void trap(int vector)                 { emit(0xF000 | vector); }
+
+/* the branch over the data to the entry, patched by entry() */
+static int skip;
+
+static void begin(void)
+{
+    skip = here();
+    emit(0);
+}
+
+static int entry(void)
+{
+    words[skip] = (N | Z | P) << 9 | ((here() - (skip + 1)) & 0x1FF);
+    return here();
+}
+
+static int fill(uint16_t value)
+{
+    emit(value);
+    return count - 1;
+}
+
+/* every kernel runs its body 'inner' times with R1 counting down, and that
+ * 'outer' times with R3 */
+static int outer_loop, outer_count, inner_count;
+
+static void loops_data(uint16_t outer, uint16_t inner)
+{
+    outer_count = fill(outer);
+    inner_count = fill(inner);
+}
+
+/* returns the label of the body */
+static int loops_begin(void)
+{
+    ld(R3, outer_count);
+    outer_loop = here();
+    ld(R1, inner_count);
+    return here();
+}
+
+static void loops_end(int inner)
+{
+    add_imm(R1, R1, -1);
+    br(P, inner);
+    add_imm(R3, R3, -1);
+    br(P, outer_loop);
+    trap(0x25);
+}
+
+/* 3 instructions per turn, 30M in all */
+static void kernel_alu(void)
+{
+    begin();
+    loops_data(1000, 10000);
+    entry();
+    int inner = loops_begin();
+    add(R2, R2, R1);
+    loops_end(inner);
+}
+
+/* 6 per turn over 1000 words at x4000, 30M */
+static void kernel_memwalk(void)
+{
+    begin();
+    loops_data(5000, 1000);
+    int base = fill(0x4000);
+    entry();
+    ld(R3, outer_count);
+    outer_loop = here();
+    ld(R1, inner_count);
+    ld(R4, base);
+    int inner = here();
+    ldr(R0, R4, 0);
+    add_imm(R0, R0, 1);
+    str(R0, R4, 0);
+    add_imm(R4, R4, 1);
+    loops_end(inner);
+}
+
+/* 5 per turn, 30M */
+static void kernel_indirect(void)
+{
+    begin();
+    loops_data(600, 10000);
+    int pointer = fill(0x4000);
+    entry();
+    int inner = loops_begin();
+    ldi(R0, pointer);
+    add_imm(R0, R0, 1);
+    sti(R0, pointer);
+    loops_end(inner);
+}
+
+/* 13 per turn, 29.9M */
+static void kernel_calls(void)
+{
+    begin();
+    loops_data(230, 10000);
+    int save1 = fill(0);
+    int save2 = fill(0);
+    int f3 = here();
+    add_imm(R2, R2, 1);
+    ret();
+    int f2 = here();
+    st(R7, save2);
+    jsr(f3);
+    ld(R7, save2);
+    ret();
+    int f1 = here();
+    st(R7, save1);
+    jsr(f2);
+    ld(R7, save1);
+    ret();
+    entry();
+    int inner = loops_begin();
+    jsr(f1);
+    loops_end(inner);
+}
+
+/* 4 per turn, 200K lines or 13MB of output */
+static void kernel_puts(void)
+{
+    begin();
+    loops_data(20, 10000);
+    int line = here();
+    for (const char *c = "The quick brown fox jumps over the lazy dog, again and again.."; *c; ++c)
+        emit(*c);
+    emit('\n');
+    emit(0);
+    entry();
+    int inner = loops_begin();
+    lea(R0, line);
+    trap(0x22);
+    loops_end(inner);
+}
+
+/* 5 per turn, 10M; at the end of input every poll finds a key */
+static void kernel_kbsr(void)
+{
+    begin();
+    loops_data(200, 10000);
+    int kbsr = fill(0xFE00);
+    int kbdr = fill(0xFE02);
+    entry();
+    int inner = loops_begin();
+    ldi(R0, kbsr);
+    br(Z | P, inner);
+    ldi(R0, kbdr);
+    loops_end(inner);
+}
+
+static const struct {
+    const char *name;
+    void (*build)(void);
+} kernels[] = {
+    { "alu", kernel_alu },
+    { "memwalk", kernel_memwalk },
+    { "indirect", kernel_indirect },
+    { "calls", kernel_calls },
+    { "puts", kernel_puts },
+    { "kbsr", kernel_kbsr },
+};
+
+int main(int argc, char *argv[])
+{
+    for (size_t k = 0; argc == 2 && k < sizeof(kernels) / sizeof(kernels[0]); ++k)
+    {
+        if (strcmp(argv[1], kernels[k].name) != 0)
+            continue;
+        kernels[k].build();
+
+        /* object files are big-endian, origin first */
+        putchar(ORIGIN >> 8);
+        putchar(ORIGIN & 0xFF);
+        for (int i = 0; i < count; ++i)
+        {
+            putchar(words[i] >> 8);
+            putchar(words[i] & 0xFF);
+        }
+        return 0;
+    }
+    fprintf(stderr, "usage: %s alu|memwalk|indirect|calls|puts|kbsr\n", argv[0]);
+    return 2;
+}
@@ -0,0 +1,391 @@
+/* lc3_aot: translate an LC-3 image ahead of time into C, one function per
+ * basic block reachable from PC_START. The output is compiled together with
+ * lc3_vm.c and -DLC3_AOT, which embeds the VM as the interpreter for any code
+ * the translation did not find:
+ *
+ *     ./lc3_aot test/2048.obj 2048_aot.c
+ *     gcc -O2 -DLC3_AOT -I. 2048_aot.c lc3_vm.c -o 2048_aot
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lc3_vm.h"
+
+/* the image is loaded into this guest's memory */
+static struct lc3_vm *guest;
+
+/* words loaded from the image */
+static uint16_t origin;
+static size_t image_size;
+
+/* entry PCs already translated */
+static bool translated[UINT16_MAX + 1];
+
+/* entry PCs waiting to be translated, an entry is pushed at most once per successor */
+static uint16_t worklist[4 * (UINT16_MAX + 1)];
+static size_t worklist_size;
+
+static struct {
+    uint16_t start;
+    uint16_t count;
+} blocks[UINT16_MAX + 1];
+static size_t block_count;
+
+
+/*****************************************************************************/
+static bool in_image(uint16_t address)
+{
+    return address >= origin && (size_t)(address - origin) < image_size && address < DEVICE_BASE;
+}
+
+static void push_entry(uint16_t pc)
+{
+    if (in_image(pc) && !translated[pc])
+        worklist[worklist_size++] = pc;
+}
+
+static bool ends_block(const struct uop *u)
+{
+    return u->kind == UOP_BR || u->kind == UOP_JMP || u->kind == UOP_JSR || u->kind == UOP_JSRR
+        || u->kind == UOP_TRAP || u->kind == UOP_ILLEGAL;
+}
+
+/* follow every direct control transfer from PC_START; JMP targets are not
+ * known, but the return address of every JSR is */
+static void discover(void)
+{
+    push_entry(PC_START);
+    while (worklist_size)
+    {
+        uint16_t start = worklist[--worklist_size];
+        if (translated[start])
+            continue;
+        translated[start] = true;
+
+        uint16_t count = 0;
+        uint16_t pc = start;
+        struct uop u;
+        do
+        {
+            lc3_uop_decode(&u, pc, guest->memory[pc]);
+            ++pc;
+            ++count;
+        } while (!ends_block(&u) && count < BLOCK_MAX_OPS && in_image(pc));
+
+        blocks[block_count].start = start;
+        blocks[block_count].count = count;
+        ++block_count;
+
+        if (!ends_block(&u))
+        {
+            push_entry(pc);
+            continue;
+        }
+        switch (u.kind)
+        {
+        case UOP_BR:
+            if (u.r0)
+                push_entry(u.imm);
+            if (u.r0 != 0x7)
+                push_entry(pc);
+            break;
+        case UOP_JSR:
+            push_entry(u.imm);
+            push_entry(pc);
+            break;
+        case UOP_JSRR:
+            push_entry(pc);
+            break;
+        case UOP_TRAP:
+            if (u.imm != TRAP_HALT)
+                push_entry(pc);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+
+/****************************** Code Generation ******************************/
+/* guest registers a block reads or writes, and the ones it writes */
+static void register_masks(uint16_t start, uint16_t count, uint8_t *used, uint8_t *written)
+{
+    *used = 0;
+    *written = 0;
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        struct uop u;
+        lc3_uop_decode(&u, start + i, guest->memory[(uint16_t)(start + i)]);
+        switch (u.kind)
+        {
+        case UOP_ADD:
+        case UOP_AND:
+            *used |= 1 << u.r2;
+            /* fall through */
+        case UOP_ADDI:
+        case UOP_ANDI:
+        case UOP_NOT:
+        case UOP_LDR:
+            *used |= 1 << u.r1;
+            /* fall through */
+        case UOP_LD:
+        case UOP_LD_DEVICE:
+        case UOP_LDI:
+        case UOP_LEA:
+            *written |= 1 << u.r0;
+            break;
+        case UOP_STR:
+            *used |= 1 << u.r1;
+            /* fall through */
+        case UOP_ST:
+        case UOP_ST_DEVICE:
+        case UOP_STI:
+            *used |= 1 << u.r0;
+            break;
+        case UOP_JSRR:
+            *used |= 1 << u.r1;
+            /* fall through */
+        case UOP_JSR:
+            *written |= 1 << R_R7;
+            break;
+        case UOP_JMP:
+            *used |= 1 << u.r1;
+            break;
+        default:
+            break;
+        }
+    }
+    *used |= *written;
+}
+
+/* store the block's registers and 'flag_src' as the last result (-1: unchanged) */
+static void emit_writeback(FILE *out, uint8_t written, int flag_src, const char *indent)
+{
+    for (int r = 0; r < 8; ++r)
+        if (written & (1 << r))
+            fprintf(out, "%svm->reg[R_R%d] = r%d;\n", indent, r, r);
+    if (flag_src >= 0)
+        fprintf(out, "%svm->reg[R_COND] = r%d;\n", indent, flag_src);
+}
+
+/* a memory operand: plain RAM, or lc3_mem_read() from a device page */
+static void emit_load_static(FILE *out, uint16_t address)
+{
+    if (lc3_is_device(address))
+        fprintf(out, "lc3_mem_read(vm, 0x%04x)", address);
+    else
+        fprintf(out, "vm->memory[0x%04x]", address);
+}
+
+/* only the last flag-setting op before each exit stores reg[R_COND], see lc3_flags() */
+static void emit_block(FILE *out, uint16_t start, uint16_t count)
+{
+    uint8_t used;
+    uint8_t written;
+    register_masks(start, count, &used, &written);
+
+    fprintf(out, "static int b_%04x(struct lc3_vm *vm)\n{\n", start);
+    for (int r = 0; r < 8; ++r)
+        if (used & (1 << r))
+            fprintf(out, "    uint16_t r%d = vm->reg[R_R%d];\n", r, r);
+
+    int flag_src = -1;
+    uint16_t end = start + count;
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        uint16_t pc = start + i;
+        struct uop u;
+        lc3_uop_decode(&u, pc, guest->memory[pc]);
+
+        switch (u.kind)
+        {
+        case UOP_ADD:
+            fprintf(out, "    r%d = r%d + r%d;\n", u.r0, u.r1, u.r2);
+            flag_src = u.r0;
+            break;
+        case UOP_ADDI:
+            fprintf(out, "    r%d = r%d + 0x%04x;\n", u.r0, u.r1, u.imm);
+            flag_src = u.r0;
+            break;
+        case UOP_AND:
+            fprintf(out, "    r%d = r%d & r%d;\n", u.r0, u.r1, u.r2);
+            flag_src = u.r0;
+            break;
+        case UOP_ANDI:
+            fprintf(out, "    r%d = r%d & 0x%04x;\n", u.r0, u.r1, u.imm);
+            flag_src = u.r0;
+            break;
+        case UOP_NOT:
+            fprintf(out, "    r%d = ~r%d;\n", u.r0, u.r1);
+            flag_src = u.r0;
+            break;
+        case UOP_LEA:
+            fprintf(out, "    r%d = 0x%04x;\n", u.r0, u.imm);
+            flag_src = u.r0;
+            break;
+        case UOP_LD:
+        case UOP_LD_DEVICE:
+            fprintf(out, "    r%d = ", u.r0);
+            emit_load_static(out, u.imm);
+            fprintf(out, ";\n");
+            flag_src = u.r0;
+            break;
+        case UOP_LDI:
+            fprintf(out, "    r%d = lc3_mem_read(vm, ", u.r0);
+            emit_load_static(out, u.imm);
+            fprintf(out, ");\n");
+            flag_src = u.r0;
+            break;
+        case UOP_LDR:
+            fprintf(out, "    r%d = lc3_mem_read(vm, r%d + 0x%04x);\n", u.r0, u.r1, u.imm);
+            flag_src = u.r0;
+            break;
+        case UOP_ST:
+        case UOP_ST_DEVICE:
+        case UOP_STI:
+        case UOP_STR:
+            if (u.kind == UOP_ST || u.kind == UOP_ST_DEVICE)
+                fprintf(out, "    lc3_mem_write(vm, 0x%04x, r%d);\n", u.imm, u.r0);
+            else if (u.kind == UOP_STR)
+                fprintf(out, "    lc3_mem_write(vm, r%d + 0x%04x, r%d);\n", u.r1, u.imm, u.r0);
+            else
+            {
+                fprintf(out, "    lc3_mem_write(vm, ");
+                emit_load_static(out, u.imm);
+                fprintf(out, ", r%d);\n", u.r0);
+            }
+            /* the store may have overwritten this very block or stopped the machine */
+            fprintf(out, "    if (vm->aot_stale)\n    {\n");
+            emit_writeback(out, written, flag_src, "        ");
+            fprintf(out, "        vm->reg[R_PC] = 0x%04x;\n        return %d;\n    }\n",
+                    (uint16_t)(pc + 1), i + 1);
+            break;
+        case UOP_BR:
+            emit_writeback(out, written, flag_src, "    ");
+            /* the flags of a result in this block come from its local */
+            if (u.r0 == 0x7)
+                fprintf(out, "    vm->reg[R_PC] = 0x%04x;\n", u.imm);
+            else if (u.r0 == 0)
+                fprintf(out, "    vm->reg[R_PC] = 0x%04x;\n", end);
+            else if (flag_src >= 0)
+                fprintf(out, "    vm->reg[R_PC] = (lc3_flags(r%d) & 0x%x) ? 0x%04x : 0x%04x;\n",
+                        flag_src, u.r0, u.imm, end);
+            else
+                fprintf(out, "    vm->reg[R_PC] = (lc3_flags(vm->reg[R_COND]) & 0x%x) ? 0x%04x : 0x%04x;\n",
+                        u.r0, u.imm, end);
+            break;
+        case UOP_JSR:
+            if (flag_src == R_R7)
+                fprintf(out, "    vm->reg[R_COND] = r7;\n");
+            fprintf(out, "    r7 = 0x%04x;\n", end);
+            emit_writeback(out, written, flag_src == R_R7 ? -1 : flag_src, "    ");
+            fprintf(out, "    vm->reg[R_PC] = 0x%04x;\n", u.imm);
+            break;
+        case UOP_JSRR:
+        case UOP_JMP:
+            fprintf(out, "    uint16_t target = r%d;\n", u.r1);
+            if (u.kind == UOP_JSRR)
+            {
+                if (flag_src == R_R7)
+                    fprintf(out, "    vm->reg[R_COND] = r7;\n");
+                fprintf(out, "    r7 = 0x%04x;\n", end);
+                if (flag_src == R_R7)
+                    flag_src = -1;
+            }
+            emit_writeback(out, written, flag_src, "    ");
+            fprintf(out, "    vm->reg[R_PC] = target;\n");
+            break;
+        case UOP_TRAP:
+            emit_writeback(out, written, flag_src, "    ");
+            fprintf(out, "    vm->reg[R_PC] = 0x%04x;\n    lc3_op_trap(vm, 0x%04x);\n", end, u.instr);
+            break;
+        case UOP_ILLEGAL:
+        default:
+            emit_writeback(out, written, flag_src, "    ");
+            fprintf(out, "    vm->reg[R_PC] = 0x%04x;\n    lc3_op_illegal(vm);\n", end);
+            break;
+        }
+    }
+
+    struct uop last;
+    lc3_uop_decode(&last, end - 1, guest->memory[(uint16_t)(end - 1)]);
+    if (!ends_block(&last))
+    {
+        /* a full block without a terminator falls into the next one */
+        emit_writeback(out, written, flag_src, "    ");
+        fprintf(out, "    vm->reg[R_PC] = 0x%04x;\n", end);
+    }
+    fprintf(out, "    return %d;\n}\n\n", count);
+}
+
+static void emit_program(FILE *out, const char *image_path)
+{
+    fprintf(out, "/* translated from %s by lc3_aot, do not edit */\n", image_path);
+    fprintf(out, "#include <stdlib.h>\n\n#include \"lc3_vm.h\"\n\n");
+
+    for (size_t b = 0; b < block_count; ++b)
+        emit_block(out, blocks[b].start, blocks[b].count);
+
+    fprintf(out, "const struct aot_block aot_blocks[] = {\n");
+    for (size_t b = 0; b < block_count; ++b)
+        fprintf(out, "    { 0x%04x, %d, b_%04x },\n", blocks[b].start, blocks[b].count, blocks[b].start);
+    fprintf(out, "    { 0, 0, NULL }\n};\n\n");
+
+    fprintf(out, "const uint16_t aot_origin = 0x%04x;\n\n", origin);
+    fprintf(out, "const uint16_t aot_image[] = {");
+    for (size_t i = 0; i < image_size; ++i)
+        fprintf(out, "%s0x%04x,", i % 8 ? " " : "\n    ", guest->memory[(uint16_t)(origin + i)]);
+    fprintf(out, "\n};\n\n");
+    fprintf(out, "const size_t aot_image_size = sizeof(aot_image) / sizeof(aot_image[0]);\n");
+}
+
+
+/*****************************************************************************/
+int main(int argc, const char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s image-file output.c\n", argv[0]);
+        return 2;
+    }
+
+    /* the same loader as lc3_vm, which also says where the words landed */
+    struct lc3_image *image = lc3_image_load(argv[1]);
+    if (image == NULL)
+    {
+        fprintf(stderr, "failed to load image: %s\n", argv[1]);
+        return 1;
+    }
+    if (image->count == 0)
+    {
+        fprintf(stderr, "empty image: %s\n", argv[1]);
+        return 1;
+    }
+    origin = image->origin;
+    image_size = image->count;
+    guest = lc3_vm_create();
+    if (guest == NULL || !lc3_vm_map_image(guest, image))
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    lc3_image_destroy(image);
+
+    discover();
+
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL)
+    {
+        fprintf(stderr, "cannot write %s\n", argv[2]);
+        return 1;
+    }
+    emit_program(out, argv[1]);
+    fclose(out);
+
+    fprintf(stderr, "%s: %zu blocks translated\n", argv[2], block_count);
+    lc3_vm_destroy(guest);
+    return 0;
+}
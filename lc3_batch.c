@@ -0,0 +1,594 @@
+/* lc3_batch: run a manifest of LC-3 jobs on a pool of worker threads. Every
+ * line of the manifest names an image, a file the guest reads as its
+ * keyboard ('-' for none) and a file that receives its output:
+ *
+ *     test/2048.obj  keys/2048.txt  out/2048.txt
+ *     test/rogue.obj -              out/rogue.txt
+ *
+ * Each worker keeps the jobs it runs in its own deque and gives every one of
+ * them a quantum of instructions in turn, so a long job cannot starve the
+ * others; a worker that runs dry steals from the others. With -l, up to
+ * LANE_COUNT consecutive lines naming the same image run as the lanes of one
+ * lc3_lanes, which the workers schedule like a single job.
+ */
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "lc3_vm.h"
+
+enum { BATCH_QUANTUM_DEFAULT = 1000000 };
+/* jobs a worker interleaves before it stops taking fresh ones, bounds the
+ * number of live guests to about BATCH_WINDOW per worker */
+enum { BATCH_WINDOW = 4 };
+enum { BATCH_DEQUE_SIZE = 16 };     /* a power of two above BATCH_WINDOW */
+
+struct job {
+    char *image;
+    char *input;                    /* NULL reads nothing */
+    char *output;
+    struct lc3_vm *vm;              /* created when the job first runs */
+    struct lc3_image *base;         /* shared with every job of the same image */
+    /* with -l, the first job of a group runs the next 'lanes' jobs, itself
+     * included, in 'group'; the others have lanes == 0 */
+    int lanes;
+    struct lc3_lanes *group;
+    uint64_t instructions;
+    double seconds;
+    int slices;
+    bool waiting;                   /* the last slice ended waiting for input */
+    bool failed;
+};
+
+/* the owner pops at the bottom, requeues and thieves work the top; slices are
+ * long, so the lock is only ever contended by a steal */
+struct deque {
+    pthread_mutex_t lock;
+    size_t top;
+    size_t bottom;
+    struct job *jobs[BATCH_DEQUE_SIZE];
+};
+
+struct worker {
+    pthread_t thread;
+    int index;
+    struct deque deque;
+    uint64_t slices;
+    uint64_t steals;
+};
+
+static struct job *jobs;
+static size_t job_count;
+static atomic_size_t next_job;      /* first job no worker has taken yet */
+static atomic_size_t jobs_left;     /* not finished yet */
+
+static struct worker *workers;
+static int worker_count;
+
+static const char *core = NULL;
+static bool lockstep = false;
+static uint64_t quantum = BATCH_QUANTUM_DEFAULT;
+static uint64_t limit = 0;
+
+
+/******************************** Deques *************************************/
+size_t deque_size(struct deque *d)
+{
+    pthread_mutex_lock(&d->lock);
+    size_t size = d->bottom - d->top;
+    pthread_mutex_unlock(&d->lock);
+    return size;
+}
+
+/* a job that used up its quantum goes behind the others of its worker */
+void deque_push_top(struct deque *d, struct job *job)
+{
+    pthread_mutex_lock(&d->lock);
+    d->jobs[--d->top & (BATCH_DEQUE_SIZE - 1)] = job;
+    pthread_mutex_unlock(&d->lock);
+}
+
+struct job *deque_pop_bottom(struct deque *d)
+{
+    struct job *job = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+        job = d->jobs[--d->bottom & (BATCH_DEQUE_SIZE - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+struct job *deque_steal(struct deque *d)
+{
+    struct job *job = NULL;
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom != d->top)
+        job = d->jobs[d->top++ & (BATCH_DEQUE_SIZE - 1)];
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+
+/******************************** Jobs ***************************************/
+/* the job's input and output, false with neither open if one fails */
+bool job_open(struct job *job, int *input_fd, int *output_fd)
+{
+    *input_fd = open(job->input ? job->input : "/dev/null", O_RDONLY);
+    if (*input_fd < 0)
+    {
+        fprintf(stderr, "%s: cannot read %s\n", job->image, job->input);
+        return false;
+    }
+    *output_fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (*output_fd < 0)
+    {
+        fprintf(stderr, "%s: cannot write %s\n", job->image, job->output);
+        close(*input_fd);
+        *input_fd = -1;
+        return false;
+    }
+    return true;
+}
+
+bool group_start(struct job *job)
+{
+    job->group = lc3_lanes_create(job->lanes);
+    if (job->group == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", job->image);
+        return false;
+    }
+    /* nothing to close until the files are open */
+    for (int lane = 0; lane < job->lanes; ++lane)
+    {
+        job->group->guest[lane]->input.fd = -1;
+        job->group->guest[lane]->output.fd = -1;
+        job->group->guest[lane]->yield_on_input = true;
+    }
+    for (int lane = 0; lane < job->lanes; ++lane)
+        if (!job_open(&job[lane], &job->group->guest[lane]->input.fd,
+                      &job->group->guest[lane]->output.fd))
+            return false;
+    if (!lc3_lanes_load(job->group, job->image))
+    {
+        fprintf(stderr, "failed to load image: %s\n", job->image);
+        return false;
+    }
+    job->group->limit = limit;
+    return true;
+}
+
+/* false if the job cannot run, which also finishes it */
+bool job_start(struct job *job)
+{
+    if (lockstep)
+        return group_start(job);
+
+    int input_fd, output_fd;
+    if (!job_open(job, &input_fd, &output_fd))
+        return false;
+
+    job->vm = lc3_vm_create();
+    if (job->vm == NULL)
+    {
+        fprintf(stderr, "%s: out of memory\n", job->image);
+        close(input_fd);
+        close(output_fd);
+        return false;
+    }
+    job->vm->input.fd = input_fd;
+    job->vm->output.fd = output_fd;
+    /* a guest waiting on a pipe gives the worker back */
+    job->vm->yield_on_input = true;
+    if (core)
+        lc3_vm_set_core(job->vm, core);
+    if (job->base == NULL || !lc3_vm_map_image(job->vm, job->base))
+    {
+        fprintf(stderr, "failed to load image: %s\n", job->image);
+        return false;
+    }
+    return true;
+}
+
+void job_finish(struct job *job)
+{
+    if (job->group)
+    {
+        int fds[2 * LANE_COUNT];
+        for (int lane = 0; lane < job->lanes; ++lane)
+        {
+            fds[2 * lane] = job->group->guest[lane]->input.fd;
+            fds[2 * lane + 1] = job->group->guest[lane]->output.fd;
+        }
+        lc3_lanes_destroy(job->group);
+        job->group = NULL;
+        for (int i = 0; i < 2 * job->lanes; ++i)
+            if (fds[i] >= 0)
+                close(fds[i]);
+    }
+    if (job->vm)
+    {
+        int input_fd = job->vm->input.fd;
+        int output_fd = job->vm->output.fd;
+        /* flushes the guest's output, so the file closes after it */
+        lc3_vm_destroy(job->vm);
+        job->vm = NULL;
+        close(input_fd);
+        close(output_fd);
+    }
+    atomic_fetch_sub_explicit(&jobs_left, 1, memory_order_release);
+}
+
+/* one quantum of a group, 'quantum' steps of its lanes */
+bool group_slice(struct job *job)
+{
+    if (job->group == NULL && !group_start(job))
+    {
+        for (int lane = 0; lane < job->lanes; ++lane)
+            job[lane].failed = true;
+        return true;
+    }
+
+    double start = lc3_now_seconds();
+    lc3_lanes_run(job->group, quantum);
+    double seconds = lc3_now_seconds() - start;
+    for (int lane = 0; lane < job->lanes; ++lane)
+    {
+        struct lc3_vm *guest = job->group->guest[lane];
+        job[lane].instructions = job->group->retired[lane];
+        job[lane].seconds += seconds;
+        ++job[lane].slices;
+        if (!guest->running && guest->exit_reason == LC3_EXIT_ILLEGAL && !job[lane].failed)
+        {
+            fprintf(stderr, "%s: illegal opcode at 0x%04x\n", job[lane].image,
+                    (uint16_t)(guest->reg[R_PC] - 1));
+            job[lane].failed = true;
+        }
+    }
+    job->waiting = !job->group->live && job->group->waiting;
+    return !job->group->live && !job->group->waiting;
+}
+
+/* one quantum of the job, true once it is done */
+bool job_slice(struct job *job)
+{
+    if (lockstep)
+        return group_slice(job);
+    if (job->vm == NULL && !job_start(job))
+    {
+        job->failed = true;
+        return true;
+    }
+
+    uint64_t slice = quantum;
+    if (limit && limit - job->instructions < slice)
+        slice = limit - job->instructions;
+
+    double start = lc3_now_seconds();
+    enum lc3_exit reason = lc3_vm_run(job->vm, slice);
+    job->instructions += job->vm->instr_count;
+    job->seconds += lc3_now_seconds() - start;
+    ++job->slices;
+    job->waiting = reason == LC3_EXIT_INPUT;
+
+    if (reason == LC3_EXIT_ILLEGAL)
+    {
+        fprintf(stderr, "%s: illegal opcode at 0x%04x\n", job->image,
+                (uint16_t)(job->vm->reg[R_PC] - 1));
+        job->failed = true;
+    }
+    return reason == LC3_EXIT_HALTED || reason == LC3_EXIT_ILLEGAL
+        || (limit && job->instructions >= limit);
+}
+
+
+/******************************* Workers *************************************/
+/* a job from the manifest while this worker has room for it, else one of
+ * its own, else one stolen from the next worker that has any */
+struct job *worker_next(struct worker *w)
+{
+    struct job *job = NULL;
+    if (deque_size(&w->deque) < BATCH_WINDOW)
+    {
+        /* the jobs a group took along are not scheduled on their own */
+        size_t i;
+        do
+            i = atomic_fetch_add_explicit(&next_job, 1, memory_order_relaxed);
+        while (i < job_count && jobs[i].lanes == 0);
+        if (i < job_count)
+            return &jobs[i];
+    }
+    job = deque_pop_bottom(&w->deque);
+    if (job)
+        return job;
+    for (int k = 1; k < worker_count; ++k)
+    {
+        job = deque_steal(&workers[(w->index + k) % worker_count].deque);
+        if (job)
+        {
+            ++w->steals;
+            return job;
+        }
+    }
+    return NULL;
+}
+
+void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    size_t waiting = 0;     /* slices in a row that ended waiting for input */
+    while (atomic_load_explicit(&jobs_left, memory_order_acquire) > 0)
+    {
+        struct job *job = worker_next(w);
+        if (job == NULL)
+        {
+            /* every remaining job is running on another worker */
+            usleep(1000);
+            continue;
+        }
+        ++w->slices;
+        if (job_slice(job))
+        {
+            job_finish(job);
+            waiting = 0;
+            continue;
+        }
+        deque_push_top(&w->deque, job);
+        /* once every job of the worker waits for input, so does the worker */
+        waiting = job->waiting ? waiting + 1 : 0;
+        if (waiting > deque_size(&w->deque))
+        {
+            usleep(1000);
+            waiting = 0;
+        }
+    }
+    return NULL;
+}
+
+
+/******************************** Manifest ***********************************/
+bool read_manifest(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    size_t capacity = 0;
+    char line[4096];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        ++line_number;
+        char *fields[3];
+        int count = 0;
+        for (char *field = strtok(line, " \t\r\n"); field && count < 3; field = strtok(NULL, " \t\r\n"))
+            fields[count++] = field;
+        if (count == 0 || fields[0][0] == '#')
+            continue;
+        if (count != 3)
+        {
+            fprintf(stderr, "%s:%d: expected image, input and output\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+
+        if (job_count == capacity)
+        {
+            size_t grown_capacity = capacity ? 2 * capacity : 64;
+            struct job *grown = realloc(jobs, grown_capacity * sizeof(*jobs));
+            if (grown == NULL)
+            {
+                fprintf(stderr, "%s:%d: out of memory\n", path, line_number);
+                fclose(file);
+                return false;
+            }
+            jobs = grown;
+            capacity = grown_capacity;
+        }
+
+        struct job *job = &jobs[job_count];
+        memset(job, 0, sizeof(*job));
+        job->image = strdup(fields[0]);
+        job->input = strcmp(fields[1], "-") == 0 ? NULL : strdup(fields[1]);
+        job->output = strdup(fields[2]);
+        job->lanes = 1;
+        if (job->image == NULL || job->output == NULL || (job->input == NULL && strcmp(fields[1], "-") != 0))
+        {
+            free(job->image);
+            free(job->input);
+            free(job->output);
+            fprintf(stderr, "%s:%d: out of memory\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+        ++job_count;
+    }
+    fclose(file);
+    return true;
+}
+
+
+/* load every image once, its jobs map it copy-on-write; NULL for the ones
+ * that fail, their jobs fail when they start */
+void load_images(void)
+{
+    for (size_t i = 0; i < job_count; ++i)
+    {
+        size_t first = 0;
+        while (strcmp(jobs[first].image, jobs[i].image) != 0)
+            ++first;
+        jobs[i].base = first < i ? jobs[first].base : lc3_image_load(jobs[i].image);
+    }
+}
+
+
+/* the images, each once, and what read_manifest() allocated */
+void free_jobs(void)
+{
+    for (size_t i = 0; i < job_count; ++i)
+    {
+        struct lc3_image *base = jobs[i].base;
+        if (base)
+        {
+            for (size_t j = i; j < job_count; ++j)
+                if (jobs[j].base == base)
+                    jobs[j].base = NULL;
+            lc3_image_destroy(base);
+        }
+        free(jobs[i].image);
+        free(jobs[i].input);
+        free(jobs[i].output);
+    }
+    free(jobs);
+    jobs = NULL;
+    job_count = 0;
+}
+
+
+/*****************************************************************************/
+void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-j threads] [-c core] [-l] [-q count] [-n count] [-s] manifest\n", prog);
+    fprintf(stderr, "  -j threads  worker threads (default: one per CPU)\n"
+            "  -c core     interpreter core of every guest, not with -l\n"
+            "  -l          run consecutive jobs of the same image in lockstep, up to %d at a time\n"
+            "  -q count    instructions a guest runs before the next one gets its turn (default: %d)\n"
+            "  -n count    stop each guest after 'count' instructions\n"
+            "  -s          print one line of statistics per job to stderr\n",
+            LANE_COUNT, BATCH_QUANTUM_DEFAULT);
+}
+
+/* with -l, let the first of every run of jobs on the same image take the
+ * others along */
+void group_jobs(void)
+{
+    for (size_t i = 0; i < job_count; i += jobs[i].lanes)
+    {
+        int lanes = 1;
+        while (i + lanes < job_count && lanes < LANE_COUNT
+               && strcmp(jobs[i + lanes].image, jobs[i].image) == 0)
+            jobs[i + lanes++].lanes = 0;
+        jobs[i].lanes = lanes;
+    }
+}
+
+int main(int argc, char *const argv[])
+{
+    bool stats = false;
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:c:lq:n:s")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j':
+            worker_count = atoi(optarg);
+            break;
+        case 'c':
+            core = optarg;
+            break;
+        case 'l':
+            lockstep = true;
+            break;
+        case 'q':
+            quantum = strtoull(optarg, NULL, 0);
+            break;
+        case 'n':
+            limit = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            stats = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    /* lanes only run on their own core */
+    if (optind != argc - 1 || worker_count < 1 || quantum == 0 || (core && lockstep))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+    if (core)
+    {
+        /* check the name once instead of in every job */
+        struct lc3_vm *probe = lc3_vm_create();
+        bool known = probe && lc3_vm_set_core(probe, core);
+        if (probe)
+            lc3_vm_destroy(probe);
+        if (!known)
+        {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!read_manifest(argv[optind]))
+    {
+        fprintf(stderr, "failed to read manifest: %s\n", argv[optind]);
+        free_jobs();
+        return 1;
+    }
+    size_t tasks = job_count;
+    if (!lockstep)
+        load_images();
+    else
+    {
+        group_jobs();
+        tasks = 0;
+        for (size_t i = 0; i < job_count; ++i)
+            tasks += jobs[i].lanes != 0;
+    }
+    atomic_store(&jobs_left, tasks);
+
+    double start = lc3_now_seconds();
+    workers = calloc(worker_count, sizeof(*workers));
+    for (int i = 0; i < worker_count; ++i)
+    {
+        workers[i].index = i;
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+    }
+    for (int i = 0; i < worker_count; ++i)
+        pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]);
+    for (int i = 0; i < worker_count; ++i)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = lc3_now_seconds() - start;
+
+    int failed = 0;
+    uint64_t instructions = 0;
+    for (size_t i = 0; i < job_count; ++i)
+    {
+        struct job *job = &jobs[i];
+        failed += job->failed;
+        instructions += job->instructions;
+        if (stats)
+            fprintf(stderr, "%s -> %s: %s, instructions: %llu, slices: %d, time: %.3f s\n",
+                    job->image, job->output, job->failed ? "failed" : "done",
+                    (unsigned long long)job->instructions, job->slices, job->seconds);
+    }
+    if (stats)
+    {
+        uint64_t slices = 0, steals = 0;
+        for (int i = 0; i < worker_count; ++i)
+        {
+            slices += workers[i].slices;
+            steals += workers[i].steals;
+        }
+        fprintf(stderr, "batch: %zu jobs, %d failed, %d workers, %llu slices, %llu steals, "
+                "time: %.3f s, %.2f MIPS\n",
+                job_count, failed, worker_count, (unsigned long long)slices,
+                (unsigned long long)steals, elapsed,
+                elapsed > 0 ? instructions / elapsed / 1e6 : 0.0);
+    }
+    free_jobs();
+    return failed ? 1 : 0;
+}
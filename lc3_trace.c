@@ -0,0 +1,169 @@
+/* lc3_trace: print an execution trace written by lc3_vm -t, one retired
+ * instruction per line with its PC, instruction word, the value it left in
+ * its destination register and the data address it accessed:
+ *
+ *     x3004  x6281  ldr   r=x0041  @x4001
+ *
+ * With -l only the last 'count' instructions are printed, which is where a
+ * run that stopped on an illegal opcode came from.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "lc3_vm.h"
+
+struct record {
+    uint16_t pc;
+    uint16_t instr;
+    int value;              /* -1 for none */
+    int address;            /* -1 for none */
+};
+
+static const char *const op_names[16] = {
+    "br", "add", "ld", "st", "jsr", "and", "ldr", "str",
+    "rti", "not", "ldi", "sti", "jmp", "res", "lea", "trap"
+};
+
+static bool read_byte(FILE *file, uint8_t *byte)
+{
+    int c = getc(file);
+    *byte = c;
+    return c != EOF;
+}
+
+static bool read_word(FILE *file, uint16_t *word)
+{
+    uint8_t low, high;
+    if (!read_byte(file, &low) || !read_byte(file, &high))
+        return false;
+    *word = low | (high << 8);
+    return true;
+}
+
+/* the next record, false at the end of the trace or in a truncated one */
+bool read_record(FILE *file, struct record *r, uint16_t *next_pc, uint16_t *address)
+{
+    uint8_t tag, delta;
+    uint16_t word;
+    if (!read_byte(file, &tag))
+        return false;
+
+    switch (tag & TRACE_PC_MASK)
+    {
+    case TRACE_PC_NEXT:
+        r->pc = *next_pc;
+        break;
+    case TRACE_PC_NEAR:
+        if (!read_byte(file, &delta))
+            return false;
+        r->pc = *next_pc + (int8_t)delta;
+        break;
+    case TRACE_PC_FAR:
+        if (!read_word(file, &r->pc))
+            return false;
+        break;
+    default:
+        return false;
+    }
+    if (!read_word(file, &r->instr))
+        return false;
+
+    r->value = -1;
+    if (tag & TRACE_VALUE)
+    {
+        if (!read_word(file, &word))
+            return false;
+        r->value = word;
+    }
+    r->address = -1;
+    if (tag & TRACE_ADDR_NEAR)
+    {
+        if (!read_byte(file, &delta))
+            return false;
+        *address += (int8_t)delta;
+        r->address = *address;
+    }
+    else if (tag & TRACE_ADDR_FAR)
+    {
+        if (!read_word(file, address))
+            return false;
+        r->address = *address;
+    }
+    *next_pc = r->pc + 1;
+    return true;
+}
+
+void print_record(const struct record *r)
+{
+    const char *name = op_names[r->instr >> 12];
+    printf("x%04X  x%04X  %s", r->pc, r->instr, name);
+    if (r->value >= 0 || r->address >= 0)
+        printf("%*s", 4 - (int)strlen(name), "");
+    if (r->value >= 0)
+        printf("  r=x%04X", r->value);
+    if (r->address >= 0)
+        printf("  @x%04X", r->address);
+    printf("\n");
+}
+
+int main(int argc, char *const argv[])
+{
+    size_t last = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "l:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            last = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l count] trace-file\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-l count] trace-file\n", argv[0]);
+        return 2;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (file == NULL || fread(magic, 1, sizeof(magic), file) != sizeof(magic)
+        || memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "not a trace: %s\n", argv[optind]);
+        return 1;
+    }
+
+    /* with -l, the last records go round in a ring until the end */
+    struct record *ring = last ? malloc(last * sizeof(*ring)) : NULL;
+    if (last && ring == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    uint16_t next_pc = 0;
+    uint16_t address = 0;
+    uint64_t count = 0;
+    struct record r;
+    while (read_record(file, &r, &next_pc, &address))
+    {
+        if (last)
+            ring[count % last] = r;
+        else
+            print_record(&r);
+        ++count;
+    }
+    for (uint64_t i = count > last ? count - last : 0; last && i < count; ++i)
+        print_record(&ring[i % last]);
+
+    free(ring);
+    fclose(file);
+    return 0;
+}
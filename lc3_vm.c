@@ -1,170 +1,704 @@
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <signal.h>
-#include <sys/select.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 
-/* 65536 locations, RAM is 64K * 16bit / 2 = 128KB */
-uint16_t memory[UINT16_MAX];
-
-/* whether the program is running or not */
-static bool running;
-
-/* LC-3 have 10 registers, each size is 16 bit
-  * R0-R7 : general registers
-  * PC : program couter register
-  * COND : condition flags register */
- enum {
-     R_R0 = 0,
-     R_R1,
-     R_R2,
-     R_R3,
-     R_R4,
-     R_R5,
-     R_R6,
-     R_R7,
-     R_PC,     /* program counter */
-     R_COND,
-     R_COUNT
- };
- uint16_t reg[R_COUNT];
-
-
-/* LC-3 instruction format 
-  * bit0 bit1 bit2 bit3    |    bit4 bit5 bit6 bit7 bit8 bit9 bit10 bit11 bit12 bit13 bit14 bit15
-  *           opcode                                                                       parameter
-  * LC-3 is RISC */
- enum {
-     OP_BR = 0,    /* branch */
-     OP_ADD,        /* add */
-     OP_LD,           /* load */
-     OP_ST,           /* store */
-     OP_JSR,        /* jump register */
-     OP_AND,       /* bitwise and */
-     OP_LDR,        /* load register */
-     OP_STR,        /* store register */
-     OP_RTI,         /* unused */
-     OP_NOT,       /* bitwise not */
-     OP_LDI,         /* load indirect */
-     OP_STI,         /* store indirect */
-     OP_JMP,       /* jump */
-     OP_RES,        /* reserved(unused) */
-     OP_LEA,        /* load effective address */
-     OP_TRAP      /* execute trap */
- };
-
-
- /* Condition flags register -- condition flag */
- enum {
-     FL_POS = 1 << 0,    /* positive */
-     FL_ZRO = 1 << 1,    /* zero */
-     FL_NEG = 1 << 2     /* negative */
- };
-
-
-/* the default program start position : 0x3000*/
- enum { PC_START = 0x3000 };
-
- /* trap code */
- enum {
-     TRAP_GETC = 0x20,      /* get character from keyboard, not echoed onto the terminal */
-     TRAP_OUT = 0x21,        /* output a character */
-     TRAP_PUTS = 0x22,      /* output a word string */
-     TRAP_IN = 0x23,             /* get character from keyboard, echoed onto the terminal */
-     TRAP_PUTSP = 0x24,    /* output a byte string */
-     TRAP_HALT = 0x25         /* halt the program */
- };
-
- /* device register */
- enum {
-     MR_KBSR = 0xFE00,      /* Keyboard status register */
-     MR_KBDR = 0xFE02       /* Keyboard data register */
- };
-
- static struct termios original_tio;
+#include "lc3_vm.h"
 
+/* kind of every 512-word page, lc3_mem_read() only leaves memory[] for PAGE_DEVICE */
+uint8_t lc3_page_map[PAGE_COUNT] = {
+    [DEVICE_BASE >> PAGE_SHIFT] = PAGE_DEVICE,
+};
 
-/*****************************************************************************/
-bool check_key()
+/* bump an execution counter, nothing at all unless built with LC3_COUNTERS */
+#ifdef LC3_COUNTERS
+#define COUNT(vm, counter) (++(vm)->counters.counter)
+#else
+#define COUNT(vm, counter) ((void)0)
+#endif
+
+static inline void uop_invalidate(struct lc3_vm *vm, uint16_t address)
+{
+    vm->uop_cache[address].kind = UOP_DECODE;
+}
+
+/* native code does not count, a counting build runs jit as block */
+#if defined(__x86_64__) && !defined(LC3_NO_JIT) && !defined(LC3_COUNTERS)
+#define LC3_HAVE_JIT 1
+#endif
+
+/* exits of a block that can be chained to a statically known successor */
+enum {
+    EXIT_TAKEN = 0,     /* BR taken, JSR target */
+    EXIT_FALL,          /* BR not taken, after TRAP, or end of a full block */
+    EXIT_COUNT
+};
+
+/* an exit of 'from' chained to another block, on that block's list of
+ * entries so that invalidating it only visits its predecessors */
+struct block_edge {
+    struct block *from;
+    struct block_edge *next;            /* further edges into the same block */
+    struct block_edge **prev;           /* what points at this edge */
+};
+
+/* a run of pre-decoded micro-ops from 'start' up to the first BR/JMP/JSR/TRAP */
+struct block {
+    uint16_t start;
+    uint16_t end;                       /* PC following the last micro-op */
+    uint16_t count;
+    uint16_t hits;                      /* entries, until the JIT compiles it */
+    uint8_t *native;                    /* compiled code, NULL while interpreted */
+    struct block *exits[EXIT_COUNT];    /* chained successors, NULL until first taken */
+    struct block_edge edges[EXIT_COUNT];    /* exits[] on their successors' lists */
+    struct block_edge *entries;         /* exits of other blocks chained to this one */
+    uint8_t *links[EXIT_COUNT];         /* rel32 of the native jump to each successor */
+    struct block *next;                 /* all live blocks, or the graveyard */
+    struct block **prev;                /* what points at this one in block_list */
+    struct uop ops[];
+};
+
+static void block_invalidate(struct lc3_vm *vm, uint16_t address);
+
+#ifdef LC3_HAVE_JIT
+static void jit_unlink(struct lc3_vm *vm, struct block *b, int exit);
+#else
+static inline void jit_unlink(struct lc3_vm *vm, struct block *b, int exit)
+{
+    (void)vm;
+    (void)b;
+    (void)exit;
+}
+#endif
+
+/* drop every cached translation of the word at 'address' */
+/* every store to RAM comes through here, the JIT's included */
+static inline void code_invalidate(struct lc3_vm *vm, uint16_t address)
+{
+    vm->dirty[address >> PAGE_SHIFT] = 1;
+    uop_invalidate(vm, address);
+    if (vm->block_map[address])
+        block_invalidate(vm, address);
+}
+
+
+/****************************** Display Output *******************************/
+/* append the pending output to the capture buffer, which doubles as needed;
+ * what does not fit when memory runs out is dropped like a failed write() */
+static void output_capture(struct lc3_vm *vm)
+{
+    if (vm->output.used == 0)
+        return;
+    if (vm->output.captured + vm->output.used > vm->output.capture_size)
+    {
+        size_t size = vm->output.capture_size ? vm->output.capture_size : OUTPUT_BUFFER_MAX;
+        while (size < vm->output.captured + vm->output.used)
+            size *= 2;
+        char *capture = realloc(vm->output.capture, size);
+        if (capture == NULL)
+        {
+            vm->output.used = 0;
+            return;
+        }
+        vm->output.capture = capture;
+        vm->output.capture_size = size;
+    }
+    memcpy(vm->output.capture + vm->output.captured, vm->output.buf, vm->output.used);
+    vm->output.captured += vm->output.used;
+    vm->output.used = 0;
+}
+
+/* also called before anything that waits for input and at HALT */
+static void output_flush(struct lc3_vm *vm)
+{
+    if (vm->output.fd < 0)
+    {
+        output_capture(vm);
+        return;
+    }
+
+    size_t done = 0;
+    while (done < vm->output.used)
+    {
+        ssize_t n = write(vm->output.fd, vm->output.buf + done, vm->output.used - done);
+        ++vm->output_stats.writes;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+    vm->output.used = 0;
+}
+
+static inline void output_char(struct lc3_vm *vm, char c)
+{
+    vm->output.buf[vm->output.used++] = c;
+    ++vm->output_stats.bytes;
+    if (vm->output.used >= vm->output.size || (c == '\n' && vm->output.line_flush))
+        output_flush(vm);
+}
+
+static void output_string(struct lc3_vm *vm, const char *s)
+{
+    while (*s)
+        output_char(vm, *s++);
+}
+
+#ifndef LC3_NO_MAIN
+static void print_output_stats(struct lc3_vm *vm)
+{
+    fprintf(stderr, "output: %llu bytes, %llu writes, %llu flushes unbuffered\n",
+            (unsigned long long)vm->output_stats.bytes,
+            (unsigned long long)vm->output_stats.writes,
+            (unsigned long long)vm->output_stats.requests);
+}
+#endif
+
+
+/****************************** Keyboard Input *******************************/
+enum { INPUT_EOF = 0xFFFF };        /* what getchar() used to return at the end of input */
+/* LC3_EXIT_INPUT from a TRAP that did not retire, it runs again */
+enum { EXIT_INPUT_TRAP = LC3_EXIT_COUNT };
+
+/* read once from stdin, or copy from the keys in memory, into the free
+ * part of the ring, false at end of input */
+static bool input_fill(struct lc3_vm *vm)
+{
+    size_t head = atomic_load_explicit(&vm->input.head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&vm->input.tail, memory_order_acquire);
+    size_t space = INPUT_RING_SIZE - (head - tail);
+    size_t offset = head & (INPUT_RING_SIZE - 1);
+
+    if (space > INPUT_RING_SIZE - offset)
+        space = INPUT_RING_SIZE - offset;
+    if (space == 0)
+        return true;
+
+    if (vm->input.fd < 0)
+    {
+        size_t left = vm->input.keys_size - vm->input.keys_taken;
+        if (left == 0)
+        {
+            atomic_store_explicit(&vm->input.eof, true, memory_order_release);
+            return false;
+        }
+        if (space > left)
+            space = left;
+        memcpy(vm->input.ring + offset, vm->input.keys + vm->input.keys_taken, space);
+        vm->input.keys_taken += space;
+        atomic_store_explicit(&vm->input.head, head + space, memory_order_release);
+        return true;
+    }
+
+    ssize_t n;
+    do
+    {
+        n = read(vm->input.fd, vm->input.ring + offset, space);
+        ++vm->input_stats.reads;
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+    {
+        atomic_store_explicit(&vm->input.eof, true, memory_order_release);
+        return false;
+    }
+    atomic_store_explicit(&vm->input.head, head + n, memory_order_release);
+    return true;
+}
+
+static void input_unlock(void *arg)
+{
+    pthread_mutex_unlock(arg);
+}
+
+static void *input_reader(void *arg)
+{
+    struct lc3_vm *vm = arg;
+    for (;;)
+    {
+        /* a pipe can run far ahead of a slow guest, input_take() signals once it frees space */
+        size_t head = atomic_load_explicit(&vm->input.head, memory_order_relaxed);
+        pthread_mutex_lock(&vm->input.lock);
+        pthread_cleanup_push(input_unlock, &vm->input.lock);
+        while (head - atomic_load_explicit(&vm->input.tail, memory_order_acquire) == INPUT_RING_SIZE)
+            pthread_cond_wait(&vm->input.space, &vm->input.lock);
+        pthread_cleanup_pop(1);
+        bool more = input_fill(vm);
+
+        pthread_mutex_lock(&vm->input.lock);
+        pthread_cond_signal(&vm->input.ready);
+        pthread_mutex_unlock(&vm->input.lock);
+        if (!more)
+            return NULL;
+    }
+}
+
+/* terminals and pipes can block, so they get a reader thread; files and
+ * /dev/null are read by the VM itself, which also keeps runs reproducible */
+static void input_init(struct lc3_vm *vm)
+{
+    if (vm->input.fd < 0)
+        return;
+
+    struct stat st;
+    bool can_block = isatty(vm->input.fd)
+        || (fstat(vm->input.fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)));
+
+    if (can_block && pthread_create(&vm->input.reader, NULL, input_reader, vm) == 0)
+        vm->input.threaded = true;
+}
+
+static inline bool input_pending(struct lc3_vm *vm)
+{
+    return atomic_load_explicit(&vm->input.head, memory_order_acquire)
+        != atomic_load_explicit(&vm->input.tail, memory_order_relaxed);
+}
+
+/* a key or the end of input is there to take */
+static bool input_ready(struct lc3_vm *vm)
+{
+    if (atomic_load_explicit(&vm->input.eof, memory_order_acquire) || input_pending(vm))
+        return true;
+    if (!vm->input.threaded)
+        return !input_fill(vm) || input_pending(vm);
+    return false;
+}
+
+/* wait up to 'ms' milliseconds for a key or the end of input */
+static void input_wait(struct lc3_vm *vm, long ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += ms * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&vm->input.lock);
+    while (!input_ready(vm))
+        if (pthread_cond_timedwait(&vm->input.ready, &vm->input.lock, &deadline) == ETIMEDOUT)
+            break;
+    pthread_mutex_unlock(&vm->input.lock);
+}
+
+/* the next key, INPUT_EOF once stdin has ended; waits for one if needed */
+static uint16_t input_take(struct lc3_vm *vm)
+{
+    if (!input_ready(vm))
+    {
+        pthread_mutex_lock(&vm->input.lock);
+        while (!input_ready(vm))
+            pthread_cond_wait(&vm->input.ready, &vm->input.lock);
+        pthread_mutex_unlock(&vm->input.lock);
+    }
+    if (!input_pending(vm))
+        return INPUT_EOF;
+
+    size_t tail = atomic_load_explicit(&vm->input.tail, memory_order_relaxed);
+    uint8_t key = vm->input.ring[tail & (INPUT_RING_SIZE - 1)];
+    bool was_full = atomic_load_explicit(&vm->input.head, memory_order_relaxed) - tail == INPUT_RING_SIZE;
+    atomic_store_explicit(&vm->input.tail, tail + 1, memory_order_release);
+    if (was_full && vm->input.threaded)
+    {
+        pthread_mutex_lock(&vm->input.lock);
+        pthread_cond_signal(&vm->input.space);
+        pthread_mutex_unlock(&vm->input.lock);
+    }
+    return key;
+}
+
+static void device_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+
+void lc3_mem_write(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (lc3_is_device(address))
+    {
+        device_write(vm, address, val);
+        return;
+    }
+    vm->memory[address] = val;
+    code_invalidate(vm, address);
+    ++vm->store_count;
+}
+
+double lc3_now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/***************************** Record and Replay *****************************/
+enum { REPLAY_OFF = 0, REPLAY_RECORD, REPLAY_PLAY };
+enum {
+    EVENT_IDLE = 1,     /* a KBSR poll found no key */
+    EVENT_KEY,          /* a KBSR poll took the key 'value' */
+    EVENT_GETC,         /* GETC or IN took the key 'value' */
+    EVENT_TIMER         /* a TMR read, 'value' is what it read */
+};
+enum { EVENT_BYTES = 7 };
+#define REPLAY_MAGIC "LC3R"
+
+static void replay_write(struct lc3_vm *vm)
+{
+    const struct replay_event *e = &vm->replay.last;
+    uint8_t bytes[EVENT_BYTES] = {
+        e->kind, e->value & 0xFF, e->value >> 8,
+        e->repeat & 0xFF, (e->repeat >> 8) & 0xFF, (e->repeat >> 16) & 0xFF, e->repeat >> 24
+    };
+    fwrite(bytes, 1, sizeof(bytes), vm->replay.file);
+}
+
+/* the guest read 'value' through 'kind'; a poll loop repeats its reading,
+ * which then only counts up the last event */
+static void replay_log(struct lc3_vm *vm, uint8_t kind, uint16_t value)
+{
+    struct replay_event *last = &vm->replay.last;
+    if (last->kind == kind && last->value == value && last->repeat < UINT32_MAX)
+    {
+        ++last->repeat;
+        return;
+    }
+    if (last->kind)
+        replay_write(vm);
+    last->kind = kind;
+    last->value = value;
+    last->repeat = 1;
+}
+
+bool lc3_vm_record(struct lc3_vm *vm, const char *path)
+{
+    if (vm->replay.mode != REPLAY_OFF)
+        return false;
+    vm->replay.file = fopen(path, "wb");
+    if (vm->replay.file == NULL)
+        return false;
+    fputs(REPLAY_MAGIC, vm->replay.file);
+    vm->replay.last.kind = 0;
+    vm->replay.mode = REPLAY_RECORD;
+    return true;
+}
+
+bool lc3_vm_replay(struct lc3_vm *vm, const char *path)
+{
+    if (vm->replay.mode != REPLAY_OFF)
+        return false;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    char magic[sizeof(REPLAY_MAGIC) - 1];
+    uint8_t bytes[EVENT_BYTES];
+    size_t size = 0;
+    bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+        && memcmp(magic, REPLAY_MAGIC, sizeof(magic)) == 0;
+    vm->replay.count = 0;
+    while (ok && fread(bytes, 1, sizeof(bytes), file) == sizeof(bytes))
+    {
+        if (vm->replay.count == size)
+        {
+            size = size ? 2 * size : 1024;
+            struct replay_event *grown = realloc(vm->replay.events, size * sizeof(*grown));
+            if (grown == NULL)
+            {
+                ok = false;
+                break;
+            }
+            vm->replay.events = grown;
+        }
+        struct replay_event *e = &vm->replay.events[vm->replay.count++];
+        e->kind = bytes[0];
+        e->value = bytes[1] | (bytes[2] << 8);
+        e->repeat = bytes[3] | (bytes[4] << 8) | (bytes[5] << 16) | ((uint32_t)bytes[6] << 24);
+    }
+    fclose(file);
+    if (!ok)
+        return false;
+
+    vm->replay.next = 0;
+    vm->replay.used = 0;
+    vm->replay.played = 0;
+    vm->replay.mode = REPLAY_PLAY;
+    return true;
+}
+
+/* kind of the next reading of the log, 0 at its end */
+static inline uint8_t replay_peek(struct lc3_vm *vm)
+{
+    return vm->replay.next < vm->replay.count ? vm->replay.events[vm->replay.next].kind : 0;
+}
+
+static inline uint16_t replay_take(struct lc3_vm *vm)
+{
+    const struct replay_event *e = &vm->replay.events[vm->replay.next];
+    if (++vm->replay.used >= e->repeat)
+    {
+        ++vm->replay.next;
+        vm->replay.used = 0;
+    }
+    ++vm->replay.played;
+    return e->value;
+}
+
+/* the guest read something the log does not have next, or the log ran out:
+ * from here on the devices are live */
+static void replay_end(struct lc3_vm *vm)
+{
+    fprintf(stderr, "replay %s after %llu readings\n",
+            replay_peek(vm) ? "diverged" : "ended", (unsigned long long)vm->replay.played);
+    vm->replay.mode = REPLAY_OFF;
+}
+
+/* write out the log being recorded, or drop the one being played */
+static void replay_finish(struct lc3_vm *vm)
+{
+    if (vm->replay.mode == REPLAY_RECORD)
+    {
+        if (vm->replay.last.kind)
+            replay_write(vm);
+        fclose(vm->replay.file);
+    }
+    free(vm->replay.events);
+    vm->replay.events = NULL;
+    vm->replay.mode = REPLAY_OFF;
+}
+
+
+/******************************* Device Bus **********************************/
+/* claim the registers first..last for a device, fails if any of them is taken */
+bool lc3_device_register(struct lc3_vm *vm, uint16_t first, uint16_t last, device_read_fn read, device_write_fn write)
+{
+    if (first < DEVICE_BASE || last < first)
+        return false;
+    for (uint32_t address = first; address <= last; ++address)
+        if (vm->device_slots[address - DEVICE_BASE].read || vm->device_slots[address - DEVICE_BASE].write)
+            return false;
+    for (uint32_t address = first; address <= last; ++address)
+    {
+        vm->device_slots[address - DEVICE_BASE].read = read;
+        vm->device_slots[address - DEVICE_BASE].write = write;
+    }
+    return true;
+}
+
+/* device registers are backed by memory[], which the decoded core may have executed */
+static inline void device_set(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    vm->memory[address] = val;
+    uop_invalidate(vm, address);
+}
+
+/* reads of the device page, plain RAM never gets here */
+uint16_t lc3_device_read(struct lc3_vm *vm, uint16_t address)
+{
+    COUNT(vm, device_reads);
+    device_read_fn read = vm->device_slots[address - DEVICE_BASE].read;
+    return read ? read(vm, address) : vm->memory[address];
+}
+
+static void device_write(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    COUNT(vm, device_writes);
+    ++vm->store_count;
+    device_write_fn write = vm->device_slots[address - DEVICE_BASE].write;
+    if (write)
+        write(vm, address, val);
+    else
+        device_set(vm, address, val);
+#ifdef LC3_AOT
+    if (!vm->running)
+        vm->aot_stale = true;
+#endif
+}
+
+/* a guest polling KBSR from the same PC without storing anything is waiting
+ * for a key, after IDLE_POLLS such polls the VM sleeps until one arrives or
+ * IDLE_WAIT_MS pass, or with yield_on_input or once interrupted ends the run; the block cores
+ * only set reg[R_PC] at block boundaries, which still gives the same value
+ * on every turn of a polling loop */
+enum { IDLE_POLLS = 64, IDLE_WAIT_MS = 10 };
+
+/* stop the run until there is input; the cores check running after device
+ * accesses and traps, lc3_vm_run() sets it again */
+static void input_yield(struct lc3_vm *vm, uint8_t reason)
 {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(STDIN_FILENO, &read_fds);
+    vm->running = false;
+    vm->exit_reason = reason;
+}
+
+/* the guest found KBSR empty */
+static void idle_poll(struct lc3_vm *vm)
+{
+    if (vm->reg[R_PC] != vm->idle.pc || vm->store_count != vm->idle.stores)
+    {
+        vm->idle.pc = vm->reg[R_PC];
+        vm->idle.stores = vm->store_count;
+        vm->idle.polls = 0;
+    }
+    if (++vm->idle.polls < IDLE_POLLS)
+        return;
+    if (vm->yield_on_input || vm->interrupted)
+    {
+        /* the poll already read KBSR as empty, the guest can stop anywhere after it */
+        input_yield(vm, LC3_EXIT_INPUT);
+        vm->idle.polls = 0;
+        return;
+    }
+
+    double start = lc3_now_seconds();
+    input_wait(vm, IDLE_WAIT_MS);
+    vm->idle_stats.seconds += lc3_now_seconds() - start;
+    ++vm->idle_stats.waits;
+    vm->idle.polls = 0;
+}
 
-    struct  timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &read_fds, NULL, NULL, &timeout) != 0;
+#ifndef LC3_NO_MAIN
+static void print_input_stats(struct lc3_vm *vm)
+{
+    fprintf(stderr, "input: %llu reads\n", (unsigned long long)vm->input_stats.reads);
 }
 
-void mem_write(uint16_t address, uint16_t val)
+static void print_idle_stats(struct lc3_vm *vm, double elapsed)
 {
-    memory[address] = val;
+    fprintf(stderr, "idle: %.3f s blocked in %llu waits, %.3f s executing\n",
+            vm->idle_stats.seconds, (unsigned long long)vm->idle_stats.waits,
+            elapsed - vm->idle_stats.seconds);
 }
+#endif
 
-uint16_t mem_read(uint16_t address)
+/* KBSR reports whether a key is waiting and takes it into KBDR */
+static uint16_t keyboard_read(struct lc3_vm *vm, uint16_t address)
 {
     if (address == MR_KBSR)
     {
-        if (check_key())
+        if (vm->replay.mode == REPLAY_PLAY && replay_peek(vm) != EVENT_IDLE && replay_peek(vm) != EVENT_KEY)
+            replay_end(vm);
+        bool ready = vm->replay.mode == REPLAY_PLAY ? replay_peek(vm) == EVENT_KEY : input_ready(vm);
+        if (ready)
         {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+            uint16_t key = vm->replay.mode == REPLAY_PLAY ? replay_take(vm) : input_take(vm);
+            if (vm->replay.mode == REPLAY_RECORD)
+                replay_log(vm, EVENT_KEY, key);
+            device_set(vm, MR_KBSR, 1 << 15);
+            device_set(vm, MR_KBDR, key);
+            vm->idle.polls = 0;
         }
         else
-            memory[MR_KBSR] = 0;        
+        {
+            /* the guest is waiting for a key, show it what it printed */
+            output_flush(vm);
+            device_set(vm, MR_KBSR, 0);
+            if (vm->replay.mode == REPLAY_PLAY)
+                replay_take(vm);
+            else
+            {
+                if (vm->replay.mode == REPLAY_RECORD)
+                    replay_log(vm, EVENT_IDLE, 0);
+                idle_poll(vm);
+            }
+        }
     }
-    return memory[address];
+    return vm->memory[address];
 }
 
-uint16_t sign_extend(uint16_t x, int bit_count)
+/* the display is always ready, each DDR write prints one character */
+static uint16_t display_read(struct lc3_vm *vm, uint16_t address)
 {
-    if ((x >> (bit_count - 1)) & 0x1)
-        x |= 0xFFFF << bit_count;
+    return address == MR_DSR ? (1 << 15) : vm->memory[address];
+}
 
-    return x;
+static void display_write(struct lc3_vm *vm, uint16_t address, uint16_t val)
+{
+    if (address == MR_DDR)
+    {
+        output_char(vm, (char)val);
+        ++vm->output_stats.requests;
+    }
+    device_set(vm, address, val);
 }
 
-void update_flags(uint16_t reg_index)
+/* TMR reads as ready once every TMI milliseconds, 0 stops the timer */
+static uint16_t timer_read(struct lc3_vm *vm, uint16_t address)
 {
-    if (reg[reg_index] == 0)
-        reg[R_COND] = FL_ZRO;
-    else if (reg[reg_index] >> 15)
-        reg[R_COND] = FL_NEG;
-    else
-        reg[R_COND] = FL_POS;
+    if (address == MR_TMR)
+    {
+        if (vm->replay.mode == REPLAY_PLAY && replay_peek(vm) != EVENT_TIMER)
+            replay_end(vm);
+        uint16_t ready = 0;
+        if (vm->replay.mode == REPLAY_PLAY)
+            ready = replay_take(vm);
+        else if (vm->memory[MR_TMI] && lc3_now_seconds() >= vm->timer_due)
+        {
+            ready = 1 << 15;
+            vm->timer_due = lc3_now_seconds() + vm->memory[MR_TMI] / 1e3;
+        }
+        if (vm->replay.mode == REPLAY_RECORD)
+            replay_log(vm, EVENT_TIMER, ready);
+        device_set(vm, MR_TMR, ready);
+    }
+    return vm->memory[address];
 }
 
-void disable_input_buffering()
+static void timer_write(struct lc3_vm *vm, uint16_t address, uint16_t val)
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    device_set(vm, address, val);
+    if (address == MR_TMI)
+        vm->timer_due = lc3_now_seconds() + val / 1e3;
 }
 
-void restore_input_buffering()
+/* clearing bit 15 of MCR stops the clock, i.e. halts the machine */
+static void mcr_write(struct lc3_vm *vm, uint16_t address, uint16_t val)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    device_set(vm, address, val);
+    if (!(val >> 15))
+        vm->running = false;
+}
+
+static void devices_init(struct lc3_vm *vm)
+{
+    lc3_device_register(vm, MR_KBSR, MR_KBDR, keyboard_read, NULL);
+    lc3_device_register(vm, MR_DSR, MR_DDR, display_read, display_write);
+    lc3_device_register(vm, MR_TMR, MR_TMI, timer_read, timer_write);
+    lc3_device_register(vm, MR_MCR, MR_MCR, NULL, mcr_write);
+    device_set(vm, MR_MCR, 1 << 15);
+}
+
+static uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 0x1)
+        x |= 0xFFFF << bit_count;
+
+    return x;
 }
 
-void handle_interrupt(int signal)
+/* only the result is kept, BR derives N/Z/P from it with lc3_flags() */
+static void update_flags(struct lc3_vm *vm, uint16_t reg_index)
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
+    vm->reg[R_COND] = vm->reg[reg_index];
 }
 
 
 /*****************************************************************************/
 /* OP_ADD */
-void op_add(uint16_t instr)
+static void op_add(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t src_reg1 = (instr >> 6) & 0x7;
@@ -173,18 +707,18 @@ void op_add(uint16_t instr)
     if (imm5_flag)
     {
         uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[dst_reg] = reg[src_reg1] + imm5;
+        vm->reg[dst_reg] = vm->reg[src_reg1] + imm5;
     }
     else
     {
         uint16_t src_reg2 = instr   & 0x7;
-         reg[dst_reg] = reg[src_reg1] +  reg[src_reg2];
+         vm->reg[dst_reg] = vm->reg[src_reg1] +  vm->reg[src_reg2];
     }
-    update_flags(dst_reg);
+    update_flags(vm, dst_reg);
 }
 
 /* OP_AND */
-void op_and(uint16_t instr)
+static void op_and(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t src_reg1 = (instr >> 6) & 0x7;
@@ -193,218 +727,266 @@ void op_and(uint16_t instr)
     if (imm5_flag)
     {
         uint16_t imm5 = sign_extend(instr & 0x1F, 5);
-        reg[dst_reg] = reg[src_reg1] & imm5;
+        vm->reg[dst_reg] = vm->reg[src_reg1] & imm5;
     }
     else
     {
         uint16_t src_reg2 = instr & 0x7;
-        reg[dst_reg] = reg[src_reg1] & reg[src_reg2];
+        vm->reg[dst_reg] = vm->reg[src_reg1] & vm->reg[src_reg2];
     }   
-    update_flags(dst_reg);
+    update_flags(vm, dst_reg);
 }
 
 /* OP_NOT */
-void op_not(uint16_t instr)
+static void op_not(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t src_reg = (instr >> 6) & 0x7;
 
-    reg[dst_reg] = ~reg[src_reg];
-    update_flags(dst_reg);
+    vm->reg[dst_reg] = ~vm->reg[src_reg];
+    update_flags(vm, dst_reg);
 }
 
 /* OP_BR */
-void op_br(uint16_t instr)
+static void op_br(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t pc_offset9 =  sign_extend(instr & 0x1FF, 9);
     uint16_t cond_flag = (instr >> 9) & 0x7;
-    if (cond_flag & reg[R_COND])
-        reg[R_PC] += pc_offset9;
+    if (cond_flag & lc3_flags(vm->reg[R_COND]))
+    {
+        COUNT(vm, br_taken);
+        vm->reg[R_PC] += pc_offset9;
+    }
+    else
+        COUNT(vm, br_not_taken);
 }
 
 /* OP_JMP */
-void op_jmp(uint16_t instr)
+static void op_jmp(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t base_reg = (instr >> 6) & 0x7;
-    reg[R_PC] = reg[base_reg];
+    vm->reg[R_PC] = vm->reg[base_reg];
 }
 
 /* OP_JSR */
-void op_jsr(uint16_t instr)
+static void op_jsr(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t long_flag = (instr >> 11) & 0x1;
 
-    reg[R_R7] = reg[R_PC];
+    vm->reg[R_R7] = vm->reg[R_PC];
     if (long_flag)
     {
         uint16_t pc_offset11 = sign_extend(instr & 0x7FF, 11);
-        reg[R_PC] += pc_offset11;
+        vm->reg[R_PC] += pc_offset11;
     }
     else
     {
         uint16_t base_reg = (instr >> 6) & 0x7;
-        reg[R_PC] = reg[base_reg];
+        vm->reg[R_PC] = vm->reg[base_reg];
     }
 }
 
 /* OP_LD */
-void op_ld(uint16_t instr)
+static void op_ld(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t pc_offset9 = sign_extend(instr & 0x1FF, 9);
 
-    reg[dst_reg] = mem_read(reg[R_PC] + pc_offset9);
-    update_flags(dst_reg);
+    vm->reg[dst_reg] = lc3_mem_read(vm, vm->reg[R_PC] + pc_offset9);
+    update_flags(vm, dst_reg);
 }
 
 /* OP_LDI */
-void op_ldi(uint16_t instr)
+static void op_ldi(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t pc_offset9 = sign_extend(instr & 0x1FF, 9);
 
-    uint16_t address = mem_read(reg[R_PC] + pc_offset9);
-    reg[dst_reg] = mem_read(address);
-    update_flags(dst_reg);
+    uint16_t address = lc3_mem_read(vm, vm->reg[R_PC] + pc_offset9);
+    vm->reg[dst_reg] = lc3_mem_read(vm, address);
+    update_flags(vm, dst_reg);
 }
 
 /* OP_LDR */
-void op_ldr(uint16_t instr)
+static void op_ldr(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t base_reg = (instr >> 6) & 0x7;
     uint16_t pc_offset6 = sign_extend(instr & 0x3F, 6);
 
-    reg[dst_reg] = mem_read(reg[base_reg] + pc_offset6);
-    update_flags(dst_reg);
+    vm->reg[dst_reg] = lc3_mem_read(vm, vm->reg[base_reg] + pc_offset6);
+    update_flags(vm, dst_reg);
 }
 
 /* OP_LEA */
-void op_lea(uint16_t instr)
+static void op_lea(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t dst_reg = (instr >> 9) & 0x7;
     uint16_t pc_offset9 = sign_extend(instr & 0x1FF, 9);
 
-    reg[dst_reg] = reg[R_PC] + pc_offset9;
-    update_flags(dst_reg);
+    vm->reg[dst_reg] = vm->reg[R_PC] + pc_offset9;
+    update_flags(vm, dst_reg);
 }
 
 /* OP_ST */
-void op_st(uint16_t instr)
+static void op_st(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t src_reg = (instr >> 9) & 0x7;
     uint16_t pc_offset9 = sign_extend(instr & 0x1FF, 9);
     
-    uint16_t address = reg[R_PC] + pc_offset9;
-    mem_write(address, reg[src_reg]);
+    uint16_t address = vm->reg[R_PC] + pc_offset9;
+    lc3_mem_write(vm, address, vm->reg[src_reg]);
 }
 
 /* OP_STI */
-void op_sti(uint16_t instr)
+static void op_sti(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t src_reg = (instr >> 9) & 0x7;
     uint16_t pc_offset9 = sign_extend(instr & 0x1FF, 9);
 
-    uint16_t address = mem_read(reg[R_PC] + pc_offset9);
-    mem_write(address, reg[src_reg]);
+    uint16_t address = lc3_mem_read(vm, vm->reg[R_PC] + pc_offset9);
+    lc3_mem_write(vm, address, vm->reg[src_reg]);
 }
 
 /* OP_STR */
-void op_str(uint16_t instr)
+static void op_str(struct lc3_vm *vm, uint16_t instr)
 {
     uint16_t src_reg = (instr >> 9) & 0x7;
     uint16_t base_reg = (instr >> 6) & 0x7;
     uint16_t pc_offset6 = sign_extend(instr & 0x3F, 6);
 
-    uint16_t address = reg[base_reg] + pc_offset6;
-    mem_write(address, reg[src_reg]);
+    uint16_t address = vm->reg[base_reg] + pc_offset6;
+    lc3_mem_write(vm, address, vm->reg[src_reg]);
 }
 
 
 /****************************** Trap Routine *********************************/
+/* with yield_on_input, or once the VM is interrupted, a GETC or IN that
+ * finds no key ends the run and executes again in the next one, reg[R_PC]
+ * already points past it */
+static bool trap_would_block(struct lc3_vm *vm)
+{
+    /* a log that has no key here falls back to the live input, which waits like any other */
+    if (vm->replay.mode == REPLAY_PLAY && replay_peek(vm) != EVENT_GETC)
+        replay_end(vm);
+    if (vm->replay.mode == REPLAY_PLAY || input_ready(vm))
+        return false;
+    if (!vm->yield_on_input)
+    {
+        /* wait here rather than in input_take(), where an interrupt could not end the run */
+        while (!vm->interrupted && !input_ready(vm))
+            input_wait(vm, IDLE_WAIT_MS);
+        if (!vm->interrupted)
+            return false;
+    }
+    output_flush(vm);
+    --vm->reg[R_PC];
+    input_yield(vm, EXIT_INPUT_TRAP);
+    return true;
+}
+
+/* the key of a GETC or IN, once trap_would_block() found one */
+static uint16_t trap_key(struct lc3_vm *vm)
+{
+    if (vm->replay.mode == REPLAY_PLAY)
+        return replay_take(vm);
+    uint16_t key = input_take(vm);
+    if (vm->replay.mode == REPLAY_RECORD)
+        replay_log(vm, EVENT_GETC, key);
+    return key;
+}
+
 /* TRAP_GETC */
-void trap_getc()
+static void trap_getc(struct lc3_vm *vm)
 {
-    reg[R_R0] = (uint16_t)getchar();
+    if (trap_would_block(vm))
+        return;
+    output_flush(vm);
+    vm->reg[R_R0] = trap_key(vm);
 }
 
 /* TRAP_OUT */
-void trap_out()
+static void trap_out(struct lc3_vm *vm)
 {
-    putc((char)reg[R_R0], stdout);
-    fflush(stdout);
+    output_char(vm, (char)vm->reg[R_R0]);
+    ++vm->output_stats.requests;
 }
 
 /* TRAP_PUTS */
-void trap_puts()
+static void trap_puts(struct lc3_vm *vm)
 {
     /* one char per word */
-    uint16_t *ptr_c = memory + reg[R_R0];
+    uint16_t *ptr_c = vm->memory + vm->reg[R_R0];
     while ( *ptr_c)
     {
-        putc((char)*ptr_c, stdout);
+        output_char(vm, (char)*ptr_c);
         ++ptr_c;
     }
-    fflush(stdout);
+    ++vm->output_stats.requests;
 }
 
 /* TRAP_IN */
-void trap_in()
+static void trap_in(struct lc3_vm *vm)
 {
-    printf("Enter a character:\n");
-    
-    char ch = getchar();
-    putc(ch, stdout);
-    reg[R_R0] = (uint16_t)ch;
+    if (trap_would_block(vm))
+        return;
+    output_string(vm, "Enter a character:\n");
+    output_flush(vm);
+
+    char ch = trap_key(vm);
+    output_char(vm, ch);
+    vm->reg[R_R0] = (uint16_t)ch;
 }
 
 /* TRAP_PUTSP */
-void trap_putsp()
+static void trap_putsp(struct lc3_vm *vm)
 {
     /* two char per word, here we need to swap back to big endian format */
-    uint16_t *ptr_c = memory + reg[R_R0];
+    uint16_t *ptr_c = vm->memory + vm->reg[R_R0];
     while ( *ptr_c)
     {
         char ch1 = (*ptr_c) & 0xFF;
-        putc(ch1, stdout);
+        output_char(vm, ch1);
         char ch2 = (*ptr_c) >> 8;
         if (ch2)
-            putc(ch2, stdout);
+            output_char(vm, ch2);
         
         ++ptr_c;
     }
-    fflush(stdout);
+    ++vm->output_stats.requests;
 }
 
-void trap_halt()
+static void trap_halt(struct lc3_vm *vm)
 {
-    puts("HATL");
-    fflush(stdout);
-    running = false;
+    output_string(vm, "HATL\n");
+    output_flush(vm);
+    ++vm->output_stats.requests;
+    vm->running = false;
 }
 
 /* OP_TRAP */
-void op_trap(uint16_t instr)
+void lc3_op_trap(struct lc3_vm *vm, uint16_t instr)
 {
+    COUNT(vm, traps[instr & 0xFF]);
     switch (instr & 0xFF)
     {
     case TRAP_GETC:
-        trap_getc();
+        trap_getc(vm);
         break;
     case TRAP_OUT:
-        trap_out();
+        trap_out(vm);
         break;
     case TRAP_PUTS:
-        trap_puts();
+        trap_puts(vm);
         break;
     case TRAP_IN:
-        trap_in();
+        trap_in(vm);
         break;
     case TRAP_PUTSP:
-        trap_putsp();
+        trap_putsp(vm);
         break;
     case TRAP_HALT:
-        trap_halt();
+        trap_halt(vm);
         break;
     default:
         break;
@@ -412,115 +994,3693 @@ void op_trap(uint16_t instr)
 }
 
 
+/* RTI and the reserved opcode stop the machine */
+void lc3_op_illegal(struct lc3_vm *vm)
+{
+    vm->running = false;
+    vm->exit_reason = LC3_EXIT_ILLEGAL;
+}
+
+
 /*****************************************************************************/
 /* swap big-endian to little-endian */
-uint16_t swap16(uint16_t x)
+static uint16_t swap16(uint16_t x)
 {
     return (x << 8) | (x >> 8);
 }
 
-void read_image_file(FILE *file)
+/* place an image in 'memory', returns how many words it put from *origin on */
+static size_t read_image_words(uint16_t *memory, FILE *file, uint16_t *origin)
 {
     /* the first 16 bit tell us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
+    *origin = 0;
+    fread(origin, sizeof(*origin), 1, file);
+    *origin = swap16(*origin);
 
     /* we know the maximum file size so we only need  one fread */
-    uint16_t max_read = UINT16_MAX - origin;
-    uint16_t *p_curr = memory + origin;
+    uint16_t max_read = UINT16_MAX - *origin;
+    uint16_t *p_curr = memory + *origin;
     size_t actual_read = fread(p_curr, sizeof (uint16_t), max_read, file);
 
-    while (actual_read-- > 0)
-    {
-        *p_curr = swap16(*p_curr);
-        ++p_curr;
-    }
+    for (size_t i = 0; i < actual_read; ++i)
+        p_curr[i] = swap16(p_curr[i]);
+    return actual_read;
+}
+
+static void read_image_file(struct lc3_vm *vm, FILE *file)
+{
+    uint16_t origin;
+    size_t count = read_image_words(vm->memory, file, &origin);
+
+    for (size_t i = 0; i < count; ++i)
+        code_invalidate(vm, origin + i);
 }
 
-bool read_image(const char *image_path)
+static bool read_image(struct lc3_vm *vm, const char *image_path)
 {
     FILE *image_file = fopen(image_path, "rb");
     if (image_file == NULL)
         return false;
-    read_image_file(image_file);
+    read_image_file(vm, image_file);
     fclose(image_file);
 
     return true;
 }
 
 
-/*****************************************************************************/
- int main(int argc, const char* argv[])
- {
-    if (argc < 2)
-        return 0;
-    read_image(argv[1]);
-    
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
-
-    /* Set the PC to starting position */
-    reg[R_PC] = PC_START;
-
-    running = true;
-    while (running)
-    {
-         uint16_t instr = mem_read(reg[R_PC]++);
-         uint16_t op = instr >> 12;
-         switch (op)
-         {
-         case OP_ADD:
-             op_add(instr);
-             break;
-         case OP_AND:
-             op_and(instr);
-             break;
-         case OP_NOT:
-             op_not(instr);
-             break;
-         case OP_BR:
-             op_br(instr);
-             break;
-         case OP_JMP:
-            op_jmp(instr);
-             break;
-         case OP_JSR:
-            op_jsr(instr);
-             break;
-         case OP_LD:
-            op_ld(instr);
-             break;
-         case OP_LDI:
-             op_ldi(instr);
-             break;
-         case OP_LDR:
-            op_ldr(instr);
-             break;
-         case OP_LEA:
-            op_lea(instr);
-             break;
-         case OP_ST:
-             op_st(instr);
-             break;
-         case OP_STI:
-             op_sti(instr);
-             break;
-         case OP_STR:
-            op_str(instr);
-             break;
-         case OP_TRAP:
-            op_trap(instr);
-             break;
-         case OP_RES:
-         case OP_RTI:
-         default:
-             abort();
-             break;
-         }
+/****************************** Interpreter Core *****************************/
+/* labels-as-values is a GNU extension, fall back to the switch core without it */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LC3_NO_COMPUTED_GOTO)
+#define LC3_HAVE_COMPUTED_GOTO 1
+#endif
+
+enum {
+    CORE_SWITCH = 0,    /* decode with one switch per instruction */
+    CORE_THREADED,      /* direct threading with computed goto */
+    CORE_DECODED,       /* threaded over the pre-decoded cache */
+    CORE_BLOCK,         /* chained basic blocks of pre-decoded micro-ops */
+    CORE_JIT,           /* block core with hot blocks compiled to x86-64 */
+#ifdef LC3_AOT
+    CORE_AOT,           /* blocks translated ahead of time by lc3_aot */
+#endif
+    CORE_COUNT
+};
+
+static const char *core_names[CORE_COUNT] = {
+    "switch", "threaded", "decoded", "block", "jit",
+#ifdef LC3_AOT
+    "aot",
+#endif
+};
+
+#ifdef LC3_AOT
+#define CORE_DEFAULT CORE_AOT
+#else
+#define CORE_DEFAULT CORE_DECODED
+#endif
+
+/* run at most 'limit' instructions (0 means until HALT) with the switch core */
+static void run_switch(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+
+    while (vm->running && left)
+    {
+        --left;
+        /* fetches never poll a device, even from the device page */
+        uint16_t instr = vm->memory[vm->reg[R_PC]++];
+        uint16_t op = instr >> 12;
+        COUNT(vm, ops[op]);
+        switch (op)
+        {
+        case OP_ADD:
+            op_add(vm, instr);
+            break;
+        case OP_AND:
+            op_and(vm, instr);
+            break;
+        case OP_NOT:
+            op_not(vm, instr);
+            break;
+        case OP_BR:
+            op_br(vm, instr);
+            break;
+        case OP_JMP:
+            op_jmp(vm, instr);
+            break;
+        case OP_JSR:
+            op_jsr(vm, instr);
+            break;
+        case OP_LD:
+            op_ld(vm, instr);
+            break;
+        case OP_LDI:
+            op_ldi(vm, instr);
+            break;
+        case OP_LDR:
+            op_ldr(vm, instr);
+            break;
+        case OP_LEA:
+            op_lea(vm, instr);
+            break;
+        case OP_ST:
+            op_st(vm, instr);
+            break;
+        case OP_STI:
+            op_sti(vm, instr);
+            break;
+        case OP_STR:
+            op_str(vm, instr);
+            break;
+        case OP_TRAP:
+            lc3_op_trap(vm, instr);
+            break;
+        case OP_RES:
+        case OP_RTI:
+        default:
+            lc3_op_illegal(vm);
+            break;
+        }
     }
-    /* Shutdown */
-    restore_input_buffering();
+    vm->instr_count = budget - left;
+}
 
-    return 0;
- }
\ No newline at end of file
+/* same contract as run_switch(), but every handler jumps straight to the next
+ * one through its own indirect branch, so the predictor sees one branch site
+ * per opcode instead of a single shared one */
+static void run_threaded(struct lc3_vm *vm, uint64_t limit)
+{
+#ifdef LC3_HAVE_COMPUTED_GOTO
+    static void *const op_labels[16] = {
+        &&do_br, &&do_add, &&do_ld, &&do_st, &&do_jsr, &&do_and, &&do_ldr, &&do_str,
+        &&do_res, &&do_not, &&do_ldi, &&do_sti, &&do_jmp, &&do_res, &&do_lea, &&do_trap
+    };
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+    uint16_t instr;
+    /* fetched from a register like run_decoded() does, the handlers still
+     * find the PC in reg[R_PC] and the ones that change it hand it back */
+    uint16_t next = vm->reg[R_PC];
+
+/* running only changes in TRAP, in stores to MCR and in keyboard polls that
+ * yield, so it is checked there and nowhere else */
+#define DISPATCH()                                  \
+    do {                                            \
+        if (!left)                                  \
+            goto done;                              \
+        --left;                                     \
+        instr = vm->memory[next++];                 \
+        vm->reg[R_PC] = next;                       \
+        COUNT(vm, ops[instr >> 12]);                    \
+        goto *op_labels[instr >> 12];               \
+    } while (0)
+#define CHECK_DISPATCH()                            \
+    do {                                            \
+        if (!vm->running)                               \
+            goto done;                              \
+        DISPATCH();                                 \
+    } while (0)
+
+    if (!vm->running)
+        goto done;
+    DISPATCH();
+
+do_add:  op_add(vm, instr);  DISPATCH();
+do_and:  op_and(vm, instr);  DISPATCH();
+do_not:  op_not(vm, instr);  DISPATCH();
+do_br:   op_br(vm, instr);   next = vm->reg[R_PC]; DISPATCH();
+do_jmp:  op_jmp(vm, instr);  next = vm->reg[R_PC]; DISPATCH();
+do_jsr:  op_jsr(vm, instr);  next = vm->reg[R_PC]; DISPATCH();
+do_ld:   op_ld(vm, instr);   CHECK_DISPATCH();
+do_ldi:  op_ldi(vm, instr);  CHECK_DISPATCH();
+do_ldr:  op_ldr(vm, instr);  CHECK_DISPATCH();
+do_lea:  op_lea(vm, instr);  DISPATCH();
+do_st:   op_st(vm, instr);   CHECK_DISPATCH();
+do_sti:  op_sti(vm, instr);  CHECK_DISPATCH();
+do_str:  op_str(vm, instr);  CHECK_DISPATCH();
+do_trap:
+    lc3_op_trap(vm, instr);
+    next = vm->reg[R_PC];
+    if (!vm->running)
+        goto done;
+    DISPATCH();
+do_res:
+    lc3_op_illegal(vm);
+    goto done;
+
+#undef DISPATCH
+#undef CHECK_DISPATCH
+done:
+    vm->instr_count = budget - left;
+#else
+    run_switch(vm, limit);
+#endif
+}
+
+
+/* decode 'instr', fetched from 'pc', into the micro-op 'u' */
+void lc3_uop_decode(struct uop *u, uint16_t pc, uint16_t instr)
+{
+    uint16_t next_pc = pc + 1;
+
+    u->instr = instr;
+    u->r0 = (instr >> 9) & 0x7;
+    u->r1 = (instr >> 6) & 0x7;
+    u->r2 = instr & 0x7;
+    u->imm = 0;
+
+    switch (instr >> 12)
+    {
+    case OP_BR:
+        u->kind = UOP_BR;
+        u->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_ADD:
+    case OP_AND:
+        if ((instr >> 5) & 0x1)
+        {
+            u->kind = (instr >> 12) == OP_ADD ? UOP_ADDI : UOP_ANDI;
+            u->imm = sign_extend(instr & 0x1F, 5);
+        }
+        else
+            u->kind = (instr >> 12) == OP_ADD ? UOP_ADD : UOP_AND;
+        break;
+    case OP_NOT:
+        u->kind = UOP_NOT;
+        break;
+    case OP_JMP:
+        u->kind = UOP_JMP;
+        break;
+    case OP_JSR:
+        if ((instr >> 11) & 0x1)
+        {
+            u->kind = UOP_JSR;
+            u->imm = next_pc + sign_extend(instr & 0x7FF, 11);
+        }
+        else
+            u->kind = UOP_JSRR;
+        break;
+    case OP_LD:
+    case OP_LDI:
+    case OP_LEA:
+    case OP_ST:
+    case OP_STI:
+    {
+        static const uint8_t kinds[16] = {
+            [OP_LD] = UOP_LD, [OP_LDI] = UOP_LDI, [OP_LEA] = UOP_LEA,
+            [OP_ST] = UOP_ST, [OP_STI] = UOP_STI
+        };
+        u->kind = kinds[instr >> 12];
+        u->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        if (u->kind == UOP_LD && lc3_is_device(u->imm))
+            u->kind = UOP_LD_DEVICE;
+        else if (u->kind == UOP_ST && lc3_is_device(u->imm))
+            u->kind = UOP_ST_DEVICE;
+        break;
+    }
+    case OP_LDR:
+    case OP_STR:
+        u->kind = (instr >> 12) == OP_LDR ? UOP_LDR : UOP_STR;
+        u->imm = sign_extend(instr & 0x3F, 6);
+        break;
+    case OP_TRAP:
+        u->kind = UOP_TRAP;
+        u->imm = instr & 0xFF;
+        break;
+    case OP_RES:
+    case OP_RTI:
+    default:
+        u->kind = UOP_ILLEGAL;
+        break;
+    }
+}
+
+/* same contract as run_switch(), but executes from uop_cache so the fields of
+ * each instruction are only extracted the first time its word runs */
+static void run_decoded(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+    struct uop *u;
+    uint16_t pc;
+    uint16_t address;
+    /* the PC lives in a register; reg[R_PC] is only stored, a load of it
+     * after every store would put store forwarding on the critical path */
+    uint16_t next = vm->reg[R_PC];
+
+#ifdef LC3_HAVE_COMPUTED_GOTO
+    static void *const uop_labels[UOP_COUNT] = {
+        [UOP_DECODE] = &&do_UOP_DECODE, [UOP_BR] = &&do_UOP_BR,
+        [UOP_ADD] = &&do_UOP_ADD, [UOP_ADDI] = &&do_UOP_ADDI,
+        [UOP_LD] = &&do_UOP_LD, [UOP_ST] = &&do_UOP_ST,
+        [UOP_JSR] = &&do_UOP_JSR, [UOP_JSRR] = &&do_UOP_JSRR,
+        [UOP_AND] = &&do_UOP_AND, [UOP_ANDI] = &&do_UOP_ANDI,
+        [UOP_LDR] = &&do_UOP_LDR, [UOP_STR] = &&do_UOP_STR,
+        [UOP_NOT] = &&do_UOP_NOT, [UOP_LDI] = &&do_UOP_LDI,
+        [UOP_STI] = &&do_UOP_STI, [UOP_JMP] = &&do_UOP_JMP,
+        [UOP_LEA] = &&do_UOP_LEA, [UOP_TRAP] = &&do_UOP_TRAP,
+        [UOP_ILLEGAL] = &&do_UOP_ILLEGAL, [UOP_LD_DEVICE] = &&do_UOP_LD_DEVICE,
+        [UOP_ST_DEVICE] = &&do_UOP_ST_DEVICE
+    };
+#define HANDLER(kind) do_##kind
+#define NEXT()                                      \
+    do {                                            \
+        if (!left)                                  \
+            goto done;                              \
+        --left;                                     \
+        pc = next++;                                \
+        vm->reg[R_PC] = next;                       \
+        u = &vm->uop_cache[pc];                         \
+        COUNT(vm, ops[vm->memory[pc] >> 12]);           \
+        goto *uop_labels[u->kind];                  \
+    } while (0)
+#else
+#define HANDLER(kind) case kind
+#define NEXT() goto next
+#endif
+
+    if (!vm->running)
+        goto done;
+
+#ifdef LC3_HAVE_COMPUTED_GOTO
+    NEXT();
+dispatch:
+    goto *uop_labels[u->kind];
+#else
+next:
+    if (!left)
+        goto done;
+    --left;
+    pc = next++;
+    vm->reg[R_PC] = next;
+    u = &vm->uop_cache[pc];
+    COUNT(vm, ops[vm->memory[pc] >> 12]);
+dispatch:
+    switch (u->kind)
+    {
+#endif
+    HANDLER(UOP_DECODE):
+        lc3_uop_decode(u, pc, vm->memory[pc]);
+        goto dispatch;
+    HANDLER(UOP_BR):
+        if (u->r0 & lc3_flags(vm->reg[R_COND]))
+        {
+            COUNT(vm, br_taken);
+            next = u->imm;
+        }
+        else
+            COUNT(vm, br_not_taken);
+        NEXT();
+    HANDLER(UOP_ADD):
+        vm->reg[u->r0] = vm->reg[u->r1] + vm->reg[u->r2];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_ADDI):
+        vm->reg[u->r0] = vm->reg[u->r1] + u->imm;
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_AND):
+        vm->reg[u->r0] = vm->reg[u->r1] & vm->reg[u->r2];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_ANDI):
+        vm->reg[u->r0] = vm->reg[u->r1] & u->imm;
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_NOT):
+        vm->reg[u->r0] = ~vm->reg[u->r1];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_JMP):
+        next = vm->reg[u->r1];
+        NEXT();
+    HANDLER(UOP_JSR):
+        vm->reg[R_R7] = next;
+        next = u->imm;
+        NEXT();
+    HANDLER(UOP_JSRR):
+    {
+        uint16_t target = vm->reg[u->r1];
+        vm->reg[R_R7] = next;
+        next = target;
+        NEXT();
+    }
+    HANDLER(UOP_LD):
+        vm->reg[u->r0] = vm->memory[u->imm];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_LD_DEVICE):
+        address = u->imm;
+        goto device_load;
+    HANDLER(UOP_LDI):
+        address = lc3_mem_read(vm, u->imm);
+        goto load;
+    HANDLER(UOP_LDR):
+        address = vm->reg[u->r1] + u->imm;
+    load:
+        if (lc3_is_device(address))
+            goto device_load;
+        vm->reg[u->r0] = vm->memory[address];
+        update_flags(vm, u->r0);
+        NEXT();
+    device_load:
+        /* a keyboard poll may have ended the run */
+        vm->reg[u->r0] = lc3_device_read(vm, address);
+        update_flags(vm, u->r0);
+        if (!vm->running)
+            goto done;
+        NEXT();
+    HANDLER(UOP_LEA):
+        vm->reg[u->r0] = u->imm;
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_ST):
+        vm->memory[u->imm] = vm->reg[u->r0];
+        code_invalidate(vm, u->imm);
+        ++vm->store_count;
+        NEXT();
+    HANDLER(UOP_ST_DEVICE):
+        address = u->imm;
+        goto device_store;
+    HANDLER(UOP_STI):
+        address = lc3_mem_read(vm, u->imm);
+        goto store;
+    HANDLER(UOP_STR):
+        address = vm->reg[u->r1] + u->imm;
+    store:
+        if (lc3_is_device(address))
+            goto device_store;
+        vm->memory[address] = vm->reg[u->r0];
+        code_invalidate(vm, address);
+        ++vm->store_count;
+        NEXT();
+    device_store:
+        /* a store to MCR may have stopped the machine */
+        device_write(vm, address, vm->reg[u->r0]);
+        if (!vm->running)
+            goto done;
+        NEXT();
+    HANDLER(UOP_TRAP):
+        lc3_op_trap(vm, u->instr);
+        /* a GETC or IN that yields backs up the PC */
+        next = vm->reg[R_PC];
+        if (!vm->running)
+            goto done;
+        NEXT();
+    HANDLER(UOP_ILLEGAL):
+        lc3_op_illegal(vm);
+        goto done;
+#ifndef LC3_HAVE_COMPUTED_GOTO
+    default:
+        abort();
+    }
+#endif
+
+#undef HANDLER
+#undef NEXT
+done:
+    vm->reg[R_PC] = next;
+    vm->instr_count = budget - left;
+}
+
+
+/****************************** Block Cache ********************************/
+static inline bool uop_ends_block(uint8_t kind)
+{
+    return kind == UOP_BR || kind == UOP_JMP || kind == UOP_JSR || kind == UOP_JSRR
+        || kind == UOP_TRAP || kind == UOP_ILLEGAL;
+}
+
+/* translate the straight-line code at 'pc', device registers are never translated */
+static struct block *block_translate(struct lc3_vm *vm, uint16_t pc)
+{
+    struct uop ops[BLOCK_MAX_OPS];
+    uint16_t count = 0;
+    uint16_t address = pc;
+
+    do
+    {
+        lc3_uop_decode(&ops[count], address, vm->memory[address]);
+        ++address;
+    } while (!uop_ends_block(ops[count++].kind) && count < BLOCK_MAX_OPS
+             && address != 0 && address < DEVICE_BASE);
+
+    struct block *b = malloc(sizeof(*b) + count * sizeof(struct uop));
+    if (b == NULL)
+    {
+        fprintf(stderr, "out of memory translating block at 0x%04x\n", pc);
+        exit(1);
+    }
+    b->start = pc;
+    b->end = address;
+    b->count = count;
+    b->hits = 0;
+    b->native = NULL;
+    b->exits[EXIT_TAKEN] = NULL;
+    b->exits[EXIT_FALL] = NULL;
+    b->links[EXIT_TAKEN] = NULL;
+    b->links[EXIT_FALL] = NULL;
+    b->edges[EXIT_TAKEN].from = b;
+    b->edges[EXIT_FALL].from = b;
+    b->entries = NULL;
+    memcpy(b->ops, ops, count * sizeof(struct uop));
+
+    for (uint16_t i = 0; i < count; ++i)
+        ++vm->block_map[(uint16_t)(pc + i)];
+    vm->block_cache[pc] = b;
+    b->next = vm->block_list;
+    b->prev = &vm->block_list;
+    if (b->next)
+        b->next->prev = &b->next;
+    vm->block_list = b;
+    ++vm->block_stats.built;
+
+    return b;
+}
+
+/* chain exit 'exit' of 'b', which has none yet, to 'next' */
+static void block_chain(struct block *b, int exit, struct block *next)
+{
+    struct block_edge *edge = &b->edges[exit];
+    b->exits[exit] = next;
+    edge->next = next->entries;
+    edge->prev = &next->entries;
+    if (edge->next)
+        edge->next->prev = &edge->next;
+    next->entries = edge;
+}
+
+static void block_unchain(struct block *b, int exit)
+{
+    struct block_edge *edge = &b->edges[exit];
+    *edge->prev = edge->next;
+    if (edge->next)
+        edge->next->prev = edge->prev;
+    b->exits[exit] = NULL;
+}
+
+/* unlink and retire every block covering 'address', visiting only the
+ * blocks chained to them */
+static void block_invalidate(struct lc3_vm *vm, uint16_t address)
+{
+    for (int back = 0; back < BLOCK_MAX_OPS && vm->block_map[address]; ++back)
+    {
+#ifdef LC3_AOT
+        const struct aot_block *translated = vm->aot_table[(uint16_t)(address - back)];
+        if (translated && translated->count > back)
+        {
+            vm->aot_table[translated->start] = NULL;
+            for (uint16_t i = 0; i < translated->count; ++i)
+                --vm->block_map[(uint16_t)(translated->start + i)];
+            vm->aot_stale = true;
+        }
+#endif
+        struct block *dead = vm->block_cache[(uint16_t)(address - back)];
+        if (dead == NULL || dead->count <= back)
+            continue;
+
+        vm->block_cache[dead->start] = NULL;
+        for (uint16_t i = 0; i < dead->count; ++i)
+            --vm->block_map[(uint16_t)(dead->start + i)];
+
+        while (dead->entries)
+        {
+            struct block *from = dead->entries->from;
+            int e = dead->entries - from->edges;
+            block_unchain(from, e);
+            jit_unlink(vm, from, e);
+        }
+        for (int e = 0; e < EXIT_COUNT; ++e)
+            if (dead->exits[e])
+                block_unchain(dead, e);
+        *dead->prev = dead->next;
+        if (dead->next)
+            dead->next->prev = dead->prev;
+
+        dead->next = vm->block_graveyard;
+        vm->block_graveyard = dead;
+        ++vm->block_stats.invalidated;
+    }
+}
+
+static void block_reap(struct lc3_vm *vm)
+{
+    while (vm->block_graveyard)
+    {
+        struct block *dead = vm->block_graveyard;
+        vm->block_graveyard = dead->next;
+        free(dead);
+    }
+}
+
+static inline struct block *block_lookup(struct lc3_vm *vm, uint16_t pc)
+{
+    struct block *b = vm->block_cache[pc];
+    return b ? b : block_translate(vm, pc);
+}
+
+/* successor of 'b' through 'exit', reg[R_PC] already holds its entry PC;
+ * NULL sends the device page back through the dispatcher */
+static inline struct block *block_follow(struct lc3_vm *vm, struct block *b, int exit)
+{
+    struct block *next = b->exits[exit];
+    if (next)
+    {
+        ++vm->block_stats.chained;
+        return next;
+    }
+    if (vm->reg[R_PC] >= DEVICE_BASE)
+        return NULL;
+    next = block_lookup(vm, vm->reg[R_PC]);
+    block_chain(b, exit, next);
+    ++vm->block_stats.linked;
+    return next;
+}
+
+#ifndef LC3_NO_MAIN
+/* translate and chain every block reachable from reg[R_PC] along the
+ * statically known edges, for a fork server whose children then share them;
+ * a HALT ends a path so the data after it is not taken for code */
+static void block_warm(struct lc3_vm *vm)
+{
+    /* every block queues at most two successors */
+    uint16_t *pending = malloc((2 * DEVICE_BASE + 1) * sizeof(*pending));
+    size_t count = 0;
+    if (pending == NULL)
+        return;
+
+    pending[count++] = vm->reg[R_PC];
+    while (count)
+    {
+        uint16_t pc = pending[--count];
+        if (pc >= DEVICE_BASE || vm->block_cache[pc])
+            continue;
+        struct block *b = block_translate(vm, pc);
+        const struct uop *last = &b->ops[b->count - 1];
+        if ((last->kind == UOP_BR && last->r0) || last->kind == UOP_JSR)
+            pending[count++] = last->imm;
+        if (!(last->kind == UOP_BR && last->r0 == 0x7) && last->kind != UOP_JMP
+            && last->kind != UOP_ILLEGAL && !(last->kind == UOP_TRAP && last->imm == TRAP_HALT))
+            pending[count++] = b->end;
+    }
+    free(pending);
+
+    /* the links block_follow() would make */
+    for (struct block *b = vm->block_list; b; b = b->next)
+    {
+        const struct uop *last = &b->ops[b->count - 1];
+        if (((last->kind == UOP_BR && last->r0) || last->kind == UOP_JSR)
+            && vm->block_cache[last->imm])
+            block_chain(b, EXIT_TAKEN, vm->block_cache[last->imm]);
+        if ((last->kind == UOP_BR || last->kind == UOP_TRAP || !uop_ends_block(last->kind))
+            && b->end < DEVICE_BASE && vm->block_cache[b->end])
+            block_chain(b, EXIT_FALL, vm->block_cache[b->end]);
+    }
+}
+#endif
+
+/******************************* x86-64 JIT **********************************/
+#ifdef LC3_HAVE_JIT
+/* blocks entered this many times are compiled */
+enum { JIT_THRESHOLD = 64 };
+
+enum {
+    JIT_CODE_MIN = 64 << 10,        /* first code buffer, doubled by each flush */
+    JIT_CODE_SIZE = 8 << 20,        /* largest code buffer, flushed when full */
+    JIT_BLOCK_MAX_BYTES = 8192      /* upper bound of one compiled block */
+};
+
+/* exits of native code beyond the chainable ones */
+enum {
+    JIT_EXIT_INDIRECT = EXIT_COUNT, /* JMP/RET/JSRR, reg[R_PC] holds the target */
+    JIT_EXIT_SIDE,                  /* the retired count indexes the op the interpreter must run */
+    JIT_EXIT_BUDGET                 /* a chained block did not fit in the budget, nothing of it ran */
+};
+
+/* what the entry stub loads and the exit stub hands back: native code runs
+ * chained blocks until one leaves, 'block' is the one it left from */
+struct jit_frame {
+    const uint8_t *code;
+    struct uop *uops;
+    uint8_t *map;
+    uint64_t left;
+    struct block *block;
+};
+
+/* the entry stub at the start of the code buffer, returns (retired << 8) | exit
+ * where retired only counts the ops of frame->block before a side exit */
+typedef uint32_t (*jit_entry)(uint16_t *regs, uint16_t *mem, struct jit_frame *frame);
+
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+enum {
+    CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_AE = 0x3, CC_S = 0x8, CC_NS = 0x9,
+    CC_LE = 0xE, CC_G = 0xF
+};
+
+/* guest R0-R7 stay in these for the whole block; rdi holds reg[], rsi memory[],
+ * r14 uop_cache, r15 block_map and rdx the budget left, all of them set once
+ * by the entry stub; rax/rcx are scratch */
+static const uint8_t jit_host[8] = { RBX, RBP, R8, R9, R10, R11, R12, R13 };
+enum { JIT_REGS = RDI, JIT_MEM = RSI, JIT_UOPS = R14, JIT_MAP = R15, JIT_LEFT = RDX };
+
+_Static_assert(sizeof(struct uop) == 8, "JIT stores invalidate uop_cache[address * 8]");
+
+/* emission cursor, VMs on different threads compile independently */
+static _Thread_local uint8_t *jit_out;
+
+static inline void jit_byte(uint8_t b)
+{
+    *jit_out++ = b;
+}
+
+static inline void jit_u16(uint16_t v)
+{
+    memcpy(jit_out, &v, sizeof(v));
+    jit_out += sizeof(v);
+}
+
+static inline void jit_u32(uint32_t v)
+{
+    memcpy(jit_out, &v, sizeof(v));
+    jit_out += sizeof(v);
+}
+
+static inline void jit_u64(uint64_t v)
+{
+    memcpy(jit_out, &v, sizeof(v));
+    jit_out += sizeof(v);
+}
+
+/* REX prefix for 'reg' in ModRM.reg, 'index' in SIB.index and 'base' in ModRM.rm */
+static void jit_rex(bool w, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40)
+        jit_byte(rex);
+}
+
+static void jit_modrm(int mod, int reg, int rm)
+{
+    jit_byte((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* 'opcode' r/m32, r32 (mov 0x89, add 0x01, and 0x21, test 0x85), 16-bit when 'word' */
+static void jit_rr(uint8_t opcode, int rm, int reg, bool word)
+{
+    if (word)
+        jit_byte(0x66);
+    jit_rex(false, reg, 0, rm);
+    jit_byte(opcode);
+    jit_modrm(3, reg, rm);
+}
+
+/* mov r32, imm32 */
+static void jit_mov_imm(int r, uint32_t imm)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0xB8 + (r & 7));
+    jit_u32(imm);
+}
+
+/* mov r64, imm64 */
+static void jit_mov_imm64(int r, uint64_t imm)
+{
+    jit_rex(true, 0, 0, r);
+    jit_byte(0xB8 + (r & 7));
+    jit_u64(imm);
+}
+
+/* inc qword [base], base is neither rsp/r12 nor rbp/r13 */
+static void jit_inc_mem64(int base)
+{
+    jit_rex(true, 0, 0, base);
+    jit_byte(0xFF);
+    jit_modrm(0, 0, base);
+}
+
+/* group 1 ALU r/m32, imm32: add /0, and /4, cmp /7 */
+static void jit_alu_imm(int ext, int r, uint32_t imm)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0x81);
+    jit_modrm(3, ext, r);
+    jit_u32(imm);
+}
+
+/* group 1 ALU r/m64, imm32 sign-extended: sub /5, cmp /7 */
+static void jit_alu_imm64(int ext, int r, uint32_t imm)
+{
+    jit_rex(true, 0, 0, r);
+    jit_byte(0x81);
+    jit_modrm(3, ext, r);
+    jit_u32(imm);
+}
+
+/* mov r64, qword [base + disp8], 'base' is not rsp/r12 */
+static void jit_load64(int dst, int base, int8_t disp)
+{
+    jit_rex(true, dst, 0, base);
+    jit_byte(0x8B);
+    jit_modrm(1, dst, base);
+    jit_byte((uint8_t)disp);
+}
+
+/* mov qword [base + disp8], src64, 'base' is not rsp/r12 */
+static void jit_store64(int src, int base, int8_t disp)
+{
+    jit_rex(true, src, 0, base);
+    jit_byte(0x89);
+    jit_modrm(1, src, base);
+    jit_byte((uint8_t)disp);
+}
+
+/* jmp r64 */
+static void jit_jmp_reg(int r)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0xFF);
+    jit_modrm(3, 4, r);
+}
+
+/* not r32 */
+static void jit_not(int r)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0xF7);
+    jit_modrm(3, 2, r);
+}
+
+/* movzx dst32, src16 */
+static void jit_movzx(int dst, int src)
+{
+    jit_rex(false, dst, 0, src);
+    jit_byte(0x0F);
+    jit_byte(0xB7);
+    jit_modrm(3, dst, src);
+}
+
+/* movzx dst32, word [base + disp32], 'base' is neither rsp/r12 nor rbp/r13 */
+static void jit_load_disp(int dst, int base, int32_t disp)
+{
+    jit_rex(false, dst, 0, base);
+    jit_byte(0x0F);
+    jit_byte(0xB7);
+    jit_modrm(2, dst, base);
+    jit_u32(disp);
+}
+
+/* mov word [base + disp32], src16 */
+static void jit_store_disp(int src, int base, int32_t disp)
+{
+    jit_byte(0x66);
+    jit_rex(false, src, 0, base);
+    jit_byte(0x89);
+    jit_modrm(2, src, base);
+    jit_u32(disp);
+}
+
+/* mov word [base + disp32], imm16 */
+static void jit_store_disp_imm(int base, int32_t disp, uint16_t imm)
+{
+    jit_byte(0x66);
+    jit_rex(false, 0, 0, base);
+    jit_byte(0xC7);
+    jit_modrm(2, 0, base);
+    jit_u32(disp);
+    jit_u16(imm);
+}
+
+/* test word [base + disp32], imm16 */
+static void jit_test_disp_imm(int base, int32_t disp, uint16_t imm)
+{
+    jit_byte(0x66);
+    jit_rex(false, 0, 0, base);
+    jit_byte(0xF7);
+    jit_modrm(2, 0, base);
+    jit_u32(disp);
+    jit_u16(imm);
+}
+
+static void jit_sib(int scale, int index, int base)
+{
+    jit_byte((scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+/* movzx dst32, word [base + index * 2] */
+static void jit_load_idx(int dst, int base, int index)
+{
+    jit_rex(false, dst, index, base);
+    jit_byte(0x0F);
+    jit_byte(0xB7);
+    jit_modrm(0, dst, RSP);
+    jit_sib(1, index, base);
+}
+
+/* mov word [base + index * 2], src16 */
+static void jit_store_idx(int src, int base, int index)
+{
+    jit_byte(0x66);
+    jit_rex(false, src, index, base);
+    jit_byte(0x89);
+    jit_modrm(0, src, RSP);
+    jit_sib(1, index, base);
+}
+
+/* mov byte [base + index * 8], 0 */
+static void jit_clear_byte_idx8(int base, int index)
+{
+    jit_rex(false, 0, index, base);
+    jit_byte(0xC6);
+    jit_modrm(0, 0, RSP);
+    jit_sib(3, index, base);
+    jit_byte(0);
+}
+
+/* mov byte [base + index], 1 */
+static void jit_set_byte_idx(int base, int index)
+{
+    jit_rex(false, 0, index, base);
+    jit_byte(0xC6);
+    jit_modrm(0, 0, RSP);
+    jit_sib(0, index, base);
+    jit_byte(1);
+}
+
+/* shr r32, imm8 */
+static void jit_shr_imm(int r, uint8_t imm)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0xC1);
+    jit_modrm(3, 5, r);
+    jit_byte(imm);
+}
+
+/* cmp byte [base + index], 0 */
+static void jit_test_byte_idx(int base, int index)
+{
+    jit_rex(false, 0, index, base);
+    jit_byte(0x80);
+    jit_modrm(0, 7, RSP);
+    jit_sib(0, index, base);
+    jit_byte(0);
+}
+
+static void jit_push(int r)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0x50 + (r & 7));
+}
+
+static void jit_pop(int r)
+{
+    jit_rex(false, 0, 0, r);
+    jit_byte(0x58 + (r & 7));
+}
+
+/* jcc/jmp rel32, returns the displacement for jit_patch() */
+static uint8_t *jit_jcc(uint8_t cc)
+{
+    jit_byte(0x0F);
+    jit_byte(0x80 | cc);
+    uint8_t *rel = jit_out;
+    jit_u32(0);
+    return rel;
+}
+
+static uint8_t *jit_jmp()
+{
+    jit_byte(0xE9);
+    uint8_t *rel = jit_out;
+    jit_u32(0);
+    return rel;
+}
+
+static void jit_patch(uint8_t *rel, const uint8_t *target)
+{
+    int32_t disp = (int32_t)(target - (rel + 4));
+    memcpy(rel, &disp, sizeof(disp));
+}
+
+/* reg[R_COND] = guest register 'r', the flags are derived when a BR needs them */
+static void jit_emit_cond(int r)
+{
+    jit_store_disp(jit_host[r], JIT_REGS, R_COND * 2);
+}
+
+/* compile 'b' into the code buffer, false when there is no room left. Only
+ * the last flag-setting op before an exit stores reg[R_COND], see
+ * lc3_flags(). Device accesses, stores into translated code, TRAP and
+ * illegal opcodes leave through a side exit so the interpreter runs that op. */
+static bool jit_compile(struct lc3_vm *vm, struct block *b)
+{
+    if (vm->jit_size - vm->jit_used < JIT_BLOCK_MAX_BYTES)
+        return false;
+
+    uint8_t *entry = vm->jit_code + vm->jit_used;
+    jit_out = entry;
+
+    /* exits jump to the block's epilogue with the return value in eax and
+     * the budget already charged */
+    uint8_t *leaves[2 * BLOCK_MAX_OPS + 4];
+    int leave_count = 0;
+#define LEAVE(retired, exit)                                            \
+    do {                                                                \
+        if (retired)                                                    \
+            jit_alu_imm64(5, JIT_LEFT, (retired));                      \
+        jit_mov_imm(RAX, ((uint32_t)(retired) << 8) | (exit));          \
+        leaves[leave_count++] = jit_jmp();                              \
+    } while (0)
+
+    /* chainable exits store the registers themselves and jump straight into
+     * the successor once jit_link() has patched b->links[exit]; until then
+     * the jump goes to the next instruction, which leaves with reg[R_PC] = pc */
+    uint8_t *chains[EXIT_COUNT + 1];
+    int chain_count = 0;
+#define CHAIN(exit, pc)                                                 \
+    do {                                                                \
+        for (int r = 0; r < 8; ++r)                                     \
+            if (written & (1 << r))                                     \
+                jit_store_disp(jit_host[r], JIT_REGS, r * 2);           \
+        jit_alu_imm64(5, JIT_LEFT, b->count);                           \
+        b->links[exit] = jit_jmp();                                     \
+        jit_store_disp_imm(JIT_REGS, R_PC * 2, (pc));                   \
+        jit_mov_imm(RAX, ((uint32_t)b->count << 8) | (exit));           \
+        chains[chain_count++] = jit_jmp();                              \
+    } while (0)
+
+    /* conditional side exits, emitted out of line after the body */
+    struct { uint8_t *rel; uint16_t index; int flag_src; } sides[2 * BLOCK_MAX_OPS];
+    int side_count = 0;
+#define SIDE_EXIT_IF(cc)                                                \
+    do {                                                                \
+        sides[side_count].rel = jit_jcc(cc);                            \
+        sides[side_count].index = i;                                    \
+        sides[side_count].flag_src = flag_src;                          \
+        ++side_count;                                                   \
+    } while (0)
+
+    /* guest registers the block touches; written ones are loaded as well so
+     * a side exit before the write stores back the original value */
+    uint8_t used = 0;
+    uint8_t written = 0;
+    for (uint16_t i = 0; i < b->count; ++i)
+    {
+        const struct uop *u = &b->ops[i];
+        switch (u->kind)
+        {
+        case UOP_ADD:
+        case UOP_AND:
+            used |= 1 << u->r2;
+            /* fall through */
+        case UOP_ADDI:
+        case UOP_ANDI:
+        case UOP_NOT:
+        case UOP_LDR:
+            used |= 1 << u->r1;
+            /* fall through */
+        case UOP_LD:
+        case UOP_LDI:
+        case UOP_LEA:
+            written |= 1 << u->r0;
+            break;
+        case UOP_STR:
+            used |= 1 << u->r1;
+            /* fall through */
+        case UOP_ST:
+        case UOP_STI:
+            used |= 1 << u->r0;
+            break;
+        case UOP_JSRR:
+            used |= 1 << u->r1;
+            /* fall through */
+        case UOP_JSR:
+            written |= 1 << R_R7;
+            break;
+        case UOP_JMP:
+            used |= 1 << u->r1;
+            break;
+        default:
+            break;
+        }
+    }
+    used |= written;
+
+    /* a chained predecessor stored its registers and reg[R_PC] is only set
+     * when leaving, so an entry without the budget for the block says where */
+    jit_alu_imm64(7, JIT_LEFT, b->count);
+    uint8_t *short_budget = jit_jcc(CC_B);
+    for (int r = 0; r < 8; ++r)
+        if (used & (1 << r))
+            jit_load_disp(jit_host[r], JIT_REGS, r * 2);
+
+    /* guest register whose value the flags currently reflect, -1 if untouched */
+    int flag_src = -1;
+    uint16_t i;
+    for (i = 0; i < b->count; ++i)
+    {
+        const struct uop *u = &b->ops[i];
+        int d = jit_host[u->r0];
+        int s1 = jit_host[u->r1];
+        int s2 = jit_host[u->r2];
+
+        switch (u->kind)
+        {
+        case UOP_ADD:
+        case UOP_AND:
+        {
+            uint8_t opcode = u->kind == UOP_ADD ? 0x01 : 0x21;
+            if (d == s2)
+                jit_rr(opcode, d, s1, false);
+            else
+            {
+                if (d != s1)
+                    jit_rr(0x89, d, s1, false);
+                jit_rr(opcode, d, s2, false);
+            }
+            flag_src = u->r0;
+            break;
+        }
+        case UOP_ADDI:
+        case UOP_ANDI:
+            if (d != s1)
+                jit_rr(0x89, d, s1, false);
+            jit_alu_imm(u->kind == UOP_ADDI ? 0 : 4, d, (uint32_t)(int16_t)u->imm);
+            flag_src = u->r0;
+            break;
+        case UOP_NOT:
+            if (d != s1)
+                jit_rr(0x89, d, s1, false);
+            jit_not(d);
+            flag_src = u->r0;
+            break;
+        case UOP_LEA:
+            jit_mov_imm(d, u->imm);
+            flag_src = u->r0;
+            break;
+        case UOP_LD:
+            jit_load_disp(d, JIT_MEM, u->imm * 2);
+            flag_src = u->r0;
+            break;
+        case UOP_LDI:
+        case UOP_STI:
+            if (lc3_is_device(u->imm))
+                goto side_exit;
+            jit_load_disp(RAX, JIT_MEM, u->imm * 2);
+            goto access;
+        case UOP_LDR:
+        case UOP_STR:
+            jit_movzx(RAX, s1);
+            jit_alu_imm(0, RAX, u->imm);
+            jit_movzx(RAX, RAX);
+            goto access;
+        case UOP_ST:
+            jit_mov_imm(RAX, u->imm);
+        access:
+            /* eax holds the address */
+            jit_alu_imm(7, RAX, DEVICE_BASE);
+            SIDE_EXIT_IF(CC_AE);
+            if (u->kind == UOP_LDI || u->kind == UOP_LDR)
+            {
+                jit_load_idx(d, JIT_MEM, RAX);
+                flag_src = u->r0;
+            }
+            else
+            {
+                /* stores into translated code go through lc3_mem_write() */
+                jit_test_byte_idx(JIT_MAP, RAX);
+                SIDE_EXIT_IF(CC_NE);
+                jit_store_idx(d, JIT_MEM, RAX);
+                jit_clear_byte_idx8(JIT_UOPS, RAX);
+                jit_mov_imm64(RCX, (uintptr_t)&vm->store_count);
+                jit_inc_mem64(RCX);
+                /* what code_invalidate() does for the interpreters */
+                jit_mov_imm64(RCX, (uintptr_t)vm->dirty);
+                jit_shr_imm(RAX, PAGE_SHIFT);
+                jit_set_byte_idx(RCX, RAX);
+            }
+            break;
+        case UOP_BR:
+        {
+            static const int8_t br_cc[8] = { -1, CC_G, CC_E, CC_NS, CC_S, CC_NE, CC_LE, -1 };
+            uint8_t *taken = NULL;
+
+            if (flag_src < 0)
+            {
+                /* flags come from an earlier block, whose last result is in
+                 * reg[R_COND]; testing all its bits sets ZF and SF like N/Z/P */
+                if (u->r0 == 0x7)
+                    taken = jit_jmp();
+                else if (u->r0)
+                {
+                    jit_test_disp_imm(JIT_REGS, R_COND * 2, 0xFFFF);
+                    taken = jit_jcc(br_cc[u->r0]);
+                }
+            }
+            else
+            {
+                int host = jit_host[flag_src];
+                jit_emit_cond(flag_src);
+                if (u->r0 == 0x7)
+                    taken = jit_jmp();
+                else if (u->r0)
+                {
+                    jit_rr(0x85, host, host, true);
+                    taken = jit_jcc(br_cc[u->r0]);
+                }
+            }
+            CHAIN(EXIT_FALL, b->end);
+            if (taken)
+            {
+                jit_patch(taken, jit_out);
+                CHAIN(EXIT_TAKEN, u->imm);
+            }
+            goto finish;
+        }
+        case UOP_JSR:
+            if (flag_src >= 0)
+                jit_emit_cond(flag_src);
+            jit_mov_imm(jit_host[R_R7], b->end);
+            CHAIN(EXIT_TAKEN, u->imm);
+            goto finish;
+        case UOP_JSRR:
+        case UOP_JMP:
+            jit_movzx(RCX, s1);
+            if (flag_src >= 0)
+                jit_emit_cond(flag_src);
+            if (u->kind == UOP_JSRR)
+                jit_mov_imm(jit_host[R_R7], b->end);
+            jit_store_disp(RCX, JIT_REGS, R_PC * 2);
+            LEAVE(b->count, JIT_EXIT_INDIRECT);
+            goto finish;
+        case UOP_TRAP:
+        case UOP_ILLEGAL:
+        default:
+        side_exit:
+            if (flag_src >= 0)
+                jit_emit_cond(flag_src);
+            jit_store_disp_imm(JIT_REGS, R_PC * 2, b->start + i);
+            LEAVE(i, JIT_EXIT_SIDE);
+            goto finish;
+        }
+    }
+
+    /* a full block without a terminator falls into the next one */
+    if (flag_src >= 0)
+        jit_emit_cond(flag_src);
+    CHAIN(EXIT_FALL, b->end);
+
+finish:
+    for (int s = 0; s < side_count; ++s)
+    {
+        jit_patch(sides[s].rel, jit_out);
+        if (sides[s].flag_src >= 0)
+            jit_emit_cond(sides[s].flag_src);
+        jit_store_disp_imm(JIT_REGS, R_PC * 2, b->start + sides[s].index);
+        LEAVE(sides[s].index, JIT_EXIT_SIDE);
+    }
+
+    jit_patch(short_budget, jit_out);
+    jit_store_disp_imm(JIT_REGS, R_PC * 2, b->start);
+    jit_mov_imm(RAX, JIT_EXIT_BUDGET);
+    chains[chain_count++] = jit_jmp();
+
+    /* epilogue, the exit stub hands 'b' back in the frame */
+    for (int l = 0; l < leave_count; ++l)
+        jit_patch(leaves[l], jit_out);
+    for (int r = 0; r < 8; ++r)
+        if (written & (1 << r))
+            jit_store_disp(jit_host[r], JIT_REGS, r * 2);
+    for (int c = 0; c < chain_count; ++c)
+        jit_patch(chains[c], jit_out);
+    jit_mov_imm64(RCX, (uint64_t)(uintptr_t)b);
+    jit_patch(jit_jmp(), vm->jit_leave);
+#undef LEAVE
+#undef CHAIN
+#undef SIDE_EXIT_IF
+
+    vm->jit_used += jit_out - entry;
+    b->native = entry;
+    ++vm->jit_stats.compiled;
+    return true;
+}
+
+/* the entry stub saves the host registers native code uses and loads the
+ * pinned ones from the frame, the exit stub undoes that; chained blocks run
+ * between the two without coming back to C */
+static void jit_emit_stubs(struct lc3_vm *vm)
+{
+    jit_out = vm->jit_code;
+    jit_push(RBX);
+    jit_push(RBP);
+    jit_push(R12);
+    jit_push(R13);
+    jit_push(R14);
+    jit_push(R15);
+    jit_push(RDX);
+    jit_load64(JIT_UOPS, RDX, offsetof(struct jit_frame, uops));
+    jit_load64(JIT_MAP, RDX, offsetof(struct jit_frame, map));
+    jit_load64(RAX, RDX, offsetof(struct jit_frame, code));
+    jit_load64(JIT_LEFT, RDX, offsetof(struct jit_frame, left));
+    jit_jmp_reg(RAX);
+
+    /* eax holds the result, rcx the block it left from */
+    vm->jit_leave = jit_out;
+    jit_pop(R15);
+    jit_store64(JIT_LEFT, R15, offsetof(struct jit_frame, left));
+    jit_store64(RCX, R15, offsetof(struct jit_frame, block));
+    jit_pop(R15);
+    jit_pop(R14);
+    jit_pop(R13);
+    jit_pop(R12);
+    jit_pop(RBP);
+    jit_pop(RBX);
+    jit_byte(0xC3);
+    vm->jit_used = jit_out - vm->jit_code;
+}
+
+/* the code buffer is writable while the JIT emits or patches code and only
+ * executable otherwise; a failure leaves the rest of the run to the block core */
+static bool jit_protect(struct lc3_vm *vm, bool writable)
+{
+    if (mprotect(vm->jit_code, vm->jit_size,
+                 PROT_READ | (writable ? PROT_WRITE : PROT_EXEC)) == 0)
+        return true;
+    fprintf(stderr, "cannot change the code buffer protection, running without the JIT\n");
+    vm->jit_enabled = false;
+    return false;
+}
+
+/* map a writable code buffer of 'size' bytes in place of the current one */
+static bool jit_map(struct lc3_vm *vm, size_t size)
+{
+    uint8_t *code = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return false;
+    if (vm->jit_code)
+        munmap(vm->jit_code, vm->jit_size);
+    vm->jit_code = code;
+    vm->jit_size = size;
+    jit_emit_stubs(vm);
+    return true;
+}
+
+/* drop all native code, blocks start counting towards the threshold again;
+ * the buffer is writable, and twice as large while under JIT_CODE_SIZE */
+static void jit_flush(struct lc3_vm *vm)
+{
+    for (struct block *b = vm->block_list; b; b = b->next)
+    {
+        b->native = NULL;
+        b->links[EXIT_TAKEN] = NULL;
+        b->links[EXIT_FALL] = NULL;
+        b->hits = 0;
+    }
+    if (vm->jit_size >= JIT_CODE_SIZE || !jit_map(vm, 2 * vm->jit_size))
+        jit_emit_stubs(vm);
+    ++vm->jit_stats.flushes;
+}
+
+static inline void jit_translate(struct lc3_vm *vm, struct block *b)
+{
+    if (!jit_protect(vm, true))
+        return;
+    if (!jit_compile(vm, b))
+    {
+        jit_flush(vm);
+        jit_compile(vm, b);
+    }
+    jit_protect(vm, false);
+}
+
+/* make native exit 'exit' of 'b' jump straight into 'next' */
+static void jit_link(struct lc3_vm *vm, struct block *b, int exit, struct block *next)
+{
+    if (!jit_protect(vm, true))
+        return;
+    jit_patch(b->links[exit], next->native);
+    jit_protect(vm, false);
+    ++vm->jit_stats.linked;
+}
+
+/* undo jit_link(), the successor through 'exit' is going away */
+static void jit_unlink(struct lc3_vm *vm, struct block *b, int exit)
+{
+    int32_t disp;
+    if (b->links[exit] == NULL)
+        return;
+    memcpy(&disp, b->links[exit], sizeof(disp));
+    if (disp == 0 || !jit_protect(vm, true))
+        return;
+    jit_patch(b->links[exit], b->links[exit] + 4);
+    jit_protect(vm, false);
+}
+
+#ifndef LC3_NO_MAIN
+/* compile every translated block and link their native exits to the
+ * successors block_warm() chained */
+static void jit_warm(struct lc3_vm *vm)
+{
+    uint64_t flushes;
+    do
+    {
+        /* a flush drops what was compiled before it, the larger buffer takes it again */
+        flushes = vm->jit_stats.flushes;
+        for (struct block *b = vm->block_list; b && vm->jit_enabled; b = b->next)
+            if (b->native == NULL)
+                jit_translate(vm, b);
+    } while (vm->jit_stats.flushes != flushes && vm->jit_size < JIT_CODE_SIZE);
+
+    for (struct block *b = vm->block_list; b && vm->jit_enabled; b = b->next)
+        for (int e = 0; e < EXIT_COUNT; ++e)
+            if (b->native && b->links[e] && b->exits[e] && b->exits[e]->native)
+                jit_link(vm, b, e, b->exits[e]);
+}
+#endif
+
+static bool jit_init(struct lc3_vm *vm)
+{
+    /* a fork server maps and fills the buffer before its children start */
+    if (vm->jit_code)
+        return vm->jit_enabled;
+    if (!jit_map(vm, JIT_CODE_MIN))
+        return false;
+    vm->jit_enabled = true;
+    return jit_protect(vm, false);
+}
+
+#ifndef LC3_NO_MAIN
+static void print_jit_stats(struct lc3_vm *vm)
+{
+    fprintf(stderr, "jit: %llu blocks compiled, %llu flushes, %llu links, %llu native runs, "
+            "%.2f%% side exits, %zu of %zu bytes of code\n",
+            (unsigned long long)vm->jit_stats.compiled,
+            (unsigned long long)vm->jit_stats.flushes,
+            (unsigned long long)vm->jit_stats.linked,
+            (unsigned long long)vm->jit_stats.runs,
+            vm->jit_stats.runs ? 100.0 * vm->jit_stats.side_exits / vm->jit_stats.runs : 0.0,
+            vm->jit_used, vm->jit_size);
+}
+#endif
+#endif
+
+
+/* same contract as run_switch(); the budget is charged once per block, and
+ * blocks only go back through the dispatcher on JMP/RET/JSRR */
+static void run_blocks(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+    struct block *b = NULL;
+    const struct uop *u;
+    const struct uop *end;
+    uint16_t address;
+
+#ifdef LC3_HAVE_COMPUTED_GOTO
+    static void *const uop_labels[UOP_COUNT] = {
+        [UOP_DECODE] = &&do_UOP_DECODE, [UOP_BR] = &&do_UOP_BR,
+        [UOP_ADD] = &&do_UOP_ADD, [UOP_ADDI] = &&do_UOP_ADDI,
+        [UOP_LD] = &&do_UOP_LD, [UOP_ST] = &&do_UOP_ST,
+        [UOP_JSR] = &&do_UOP_JSR, [UOP_JSRR] = &&do_UOP_JSRR,
+        [UOP_AND] = &&do_UOP_AND, [UOP_ANDI] = &&do_UOP_ANDI,
+        [UOP_LDR] = &&do_UOP_LDR, [UOP_STR] = &&do_UOP_STR,
+        [UOP_NOT] = &&do_UOP_NOT, [UOP_LDI] = &&do_UOP_LDI,
+        [UOP_STI] = &&do_UOP_STI, [UOP_JMP] = &&do_UOP_JMP,
+        [UOP_LEA] = &&do_UOP_LEA, [UOP_TRAP] = &&do_UOP_TRAP,
+        [UOP_ILLEGAL] = &&do_UOP_ILLEGAL, [UOP_LD_DEVICE] = &&do_UOP_LD_DEVICE,
+        [UOP_ST_DEVICE] = &&do_UOP_ST_DEVICE
+    };
+#define HANDLER(kind) do_##kind
+#define NEXT()                                      \
+    do {                                            \
+        if (++u == end)                             \
+            goto block_end;                         \
+        COUNT(vm, ops[u->instr >> 12]);                 \
+        goto *uop_labels[u->kind];                  \
+    } while (0)
+#else
+#define HANDLER(kind) case kind
+#define NEXT()                                      \
+    do {                                            \
+        if (++u == end)                             \
+            goto block_end;                         \
+        goto next_op;                               \
+    } while (0)
+#endif
+/* leave through a chainable exit */
+#define EXIT(e)                                     \
+    do {                                            \
+        b = block_follow(vm, b, (e));                   \
+        goto enter;                                 \
+    } while (0)
+/* a store retired a block, possibly this one: resume after it via the dispatcher */
+#define STORE_CHECK()                               \
+    do {                                            \
+        if (vm->block_graveyard)                        \
+        {                                           \
+            left += end - u - 1;                    \
+            vm->reg[R_PC] = b->start + (u - b->ops) + 1;\
+            b = NULL;                               \
+            goto enter;                             \
+        }                                           \
+    } while (0)
+
+enter:
+    if (!vm->running || !left)
+        goto done;
+    if (b == NULL)
+    {
+        block_reap(vm);
+        if (vm->reg[R_PC] >= DEVICE_BASE)
+        {
+            /* code in the device page runs one instruction at a time */
+            run_switch(vm, 1);
+            --left;
+            goto enter;
+        }
+        b = block_lookup(vm, vm->reg[R_PC]);
+    }
+#ifdef LC3_HAVE_JIT
+    if (vm->jit_enabled && b->count <= left)
+    {
+        if (b->native == NULL && ++b->hits == JIT_THRESHOLD)
+            jit_translate(vm, b);
+        if (b->native)
+        {
+            struct jit_frame frame = { b->native, vm->uop_cache, vm->block_map, left, b };
+            uint32_t result = ((jit_entry)vm->jit_code)(vm->reg, vm->memory, &frame);
+            uint32_t retired = result >> 8;
+            int exit = result & 0xFF;
+
+            ++vm->jit_stats.runs;
+            left = frame.left;
+            b = frame.block;
+            switch (exit)
+            {
+            case EXIT_TAKEN:
+            case EXIT_FALL:
+            {
+                struct block *next = block_follow(vm, b, exit);
+                if (next && next->native && vm->jit_enabled)
+                    jit_link(vm, b, exit, next);
+                b = next;
+                goto enter;
+            }
+            case JIT_EXIT_INDIRECT:
+                ++vm->block_stats.indirect;
+                b = NULL;
+                goto enter;
+            case JIT_EXIT_BUDGET:
+                goto enter;
+            default:
+                /* interpret the rest of the block from the op that needs the VM */
+                ++vm->jit_stats.side_exits;
+                u = b->ops + retired;
+                end = b->ops + b->count;
+                left -= end - u;
+                goto resume;
+            }
+        }
+    }
+#endif
+    u = b->ops;
+    end = b->ops + (b->count <= left ? b->count : left);
+    left -= end - u;
+
+#ifdef LC3_HAVE_JIT
+resume:
+#endif
+#ifdef LC3_HAVE_COMPUTED_GOTO
+    COUNT(vm, ops[u->instr >> 12]);
+    goto *uop_labels[u->kind];
+#else
+next_op:
+    COUNT(vm, ops[u->instr >> 12]);
+    switch (u->kind)
+    {
+#endif
+    HANDLER(UOP_ADD):
+        vm->reg[u->r0] = vm->reg[u->r1] + vm->reg[u->r2];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_ADDI):
+        vm->reg[u->r0] = vm->reg[u->r1] + u->imm;
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_AND):
+        vm->reg[u->r0] = vm->reg[u->r1] & vm->reg[u->r2];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_ANDI):
+        vm->reg[u->r0] = vm->reg[u->r1] & u->imm;
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_NOT):
+        vm->reg[u->r0] = ~vm->reg[u->r1];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_LD):
+        vm->reg[u->r0] = vm->memory[u->imm];
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_LD_DEVICE):
+        address = u->imm;
+        goto device_load;
+    HANDLER(UOP_LDI):
+        address = lc3_mem_read(vm, u->imm);
+        goto load;
+    HANDLER(UOP_LDR):
+        address = vm->reg[u->r1] + u->imm;
+    load:
+        if (lc3_is_device(address))
+            goto device_load;
+        vm->reg[u->r0] = vm->memory[address];
+        update_flags(vm, u->r0);
+        NEXT();
+    device_load:
+        /* a keyboard poll may have ended the run */
+        vm->reg[u->r0] = lc3_device_read(vm, address);
+        update_flags(vm, u->r0);
+        if (!vm->running)
+        {
+            left += end - u - 1;
+            vm->reg[R_PC] = b->start + (u - b->ops) + 1;
+            goto done;
+        }
+        NEXT();
+    HANDLER(UOP_LEA):
+        vm->reg[u->r0] = u->imm;
+        update_flags(vm, u->r0);
+        NEXT();
+    HANDLER(UOP_ST):
+        vm->memory[u->imm] = vm->reg[u->r0];
+        code_invalidate(vm, u->imm);
+        ++vm->store_count;
+        STORE_CHECK();
+        NEXT();
+    HANDLER(UOP_ST_DEVICE):
+        address = u->imm;
+        goto device_store;
+    HANDLER(UOP_STI):
+        address = lc3_mem_read(vm, u->imm);
+        goto store;
+    HANDLER(UOP_STR):
+        address = vm->reg[u->r1] + u->imm;
+    store:
+        if (lc3_is_device(address))
+            goto device_store;
+        vm->memory[address] = vm->reg[u->r0];
+        code_invalidate(vm, address);
+        ++vm->store_count;
+        STORE_CHECK();
+        NEXT();
+    device_store:
+        /* device registers are never translated, but a store to MCR may
+         * have stopped the machine */
+        device_write(vm, address, vm->reg[u->r0]);
+        if (!vm->running)
+        {
+            left += end - u - 1;
+            vm->reg[R_PC] = b->start + (u - b->ops) + 1;
+            goto done;
+        }
+        NEXT();
+    HANDLER(UOP_BR):
+        if (u->r0 & lc3_flags(vm->reg[R_COND]))
+        {
+            COUNT(vm, br_taken);
+            vm->reg[R_PC] = u->imm;
+            EXIT(EXIT_TAKEN);
+        }
+        COUNT(vm, br_not_taken);
+        vm->reg[R_PC] = b->end;
+        EXIT(EXIT_FALL);
+    HANDLER(UOP_JSR):
+        vm->reg[R_R7] = b->end;
+        vm->reg[R_PC] = u->imm;
+        EXIT(EXIT_TAKEN);
+    HANDLER(UOP_JSRR):
+        vm->reg[R_PC] = vm->reg[u->r1];
+        vm->reg[R_R7] = b->end;
+        ++vm->block_stats.indirect;
+        b = NULL;
+        goto enter;
+    HANDLER(UOP_JMP):
+        vm->reg[R_PC] = vm->reg[u->r1];
+        ++vm->block_stats.indirect;
+        b = NULL;
+        goto enter;
+    HANDLER(UOP_TRAP):
+        vm->reg[R_PC] = b->end;
+        lc3_op_trap(vm, u->instr);
+        if (!vm->running)
+            goto done;
+        EXIT(EXIT_FALL);
+    HANDLER(UOP_ILLEGAL):
+        left += end - u - 1;
+        vm->reg[R_PC] = b->start + (u - b->ops) + 1;
+        lc3_op_illegal(vm);
+        goto done;
+    HANDLER(UOP_DECODE):
+        abort();
+#ifndef LC3_HAVE_COMPUTED_GOTO
+    default:
+        abort();
+    }
+#endif
+
+block_end:
+    if (u == b->ops + b->count)
+    {
+        /* a full block without a terminator falls into the next one */
+        vm->reg[R_PC] = b->end;
+        EXIT(EXIT_FALL);
+    }
+    /* out of budget in the middle of the block */
+    vm->reg[R_PC] = b->start + (u - b->ops);
+
+#undef HANDLER
+#undef NEXT
+#undef EXIT
+#undef STORE_CHECK
+done:
+    vm->instr_count = budget - left;
+}
+
+#ifndef LC3_NO_MAIN
+static void print_block_stats(struct lc3_vm *vm)
+{
+    uint64_t transitions = vm->block_stats.chained + vm->block_stats.linked + vm->block_stats.indirect;
+    fprintf(stderr, "blocks: %llu built, %llu invalidated, %llu transitions, "
+            "%.2f%% chained, %.2f%% indirect\n",
+            (unsigned long long)vm->block_stats.built,
+            (unsigned long long)vm->block_stats.invalidated,
+            (unsigned long long)transitions,
+            transitions ? 100.0 * vm->block_stats.chained / transitions : 0.0,
+            transitions ? 100.0 * vm->block_stats.indirect / transitions : 0.0);
+}
+#endif
+
+
+/****************************** AOT Runtime **********************************/
+#ifdef LC3_AOT
+/* load the image lc3_aot embedded, and with 'translated' route its blocks
+ * through aot_table */
+static void aot_load(struct lc3_vm *vm, bool translated)
+{
+    for (size_t i = 0; i < aot_image_size; ++i)
+    {
+        uint16_t address = aot_origin + i;
+        vm->memory[address] = aot_image[i];
+        code_invalidate(vm, address);
+    }
+    if (!translated)
+        return;
+
+    for (const struct aot_block *ab = aot_blocks; ab->fn; ++ab)
+    {
+        vm->aot_table[ab->start] = ab;
+        for (uint16_t i = 0; i < ab->count; ++i)
+            ++vm->block_map[(uint16_t)(ab->start + i)];
+    }
+}
+
+/* same contract as run_switch(); code that was not found at translation
+ * time, or was overwritten since, runs on the decoded core */
+static void run_aot(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+
+    while (vm->running && left)
+    {
+        const struct aot_block *ab = vm->aot_table[vm->reg[R_PC]];
+#ifdef LC3_COUNTERS
+        /* translated blocks do not count */
+        ab = NULL;
+#endif
+        if (ab && ab->count <= left)
+        {
+            left -= ab->fn(vm);
+            vm->aot_stale = false;
+        }
+        else
+        {
+            run_decoded(vm, 1);
+            --left;
+        }
+    }
+    vm->instr_count = budget - left;
+}
+#endif
+
+
+/***************************** Execution Trace *******************************/
+/* the VM appends records at head, the flusher writes them out from tail */
+struct lc3_trace {
+    int fd;
+    pthread_t flusher;
+    atomic_size_t head;
+    atomic_size_t tail;
+    atomic_bool stop;
+    pthread_mutex_t lock;
+    pthread_cond_t drained; /* signalled by the flusher after every write */
+    uint16_t next_pc;       /* what the last record's PC is followed by */
+    uint16_t address;       /* the last data address recorded */
+    uint8_t ring[TRACE_RING_SIZE];
+};
+
+static void *trace_flusher(void *arg)
+{
+    struct lc3_trace *t = arg;
+    for (;;)
+    {
+        /* read before head, so the pass after stop gets everything */
+        bool stop = atomic_load_explicit(&t->stop, memory_order_acquire);
+        size_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+        size_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        if (head == tail)
+        {
+            if (stop)
+                return NULL;
+            usleep(1000);
+            continue;
+        }
+
+        size_t offset = tail & (TRACE_RING_SIZE - 1);
+        size_t count = head - tail;
+        if (count > TRACE_RING_SIZE - offset)
+            count = TRACE_RING_SIZE - offset;
+        ssize_t n = write(t->fd, t->ring + offset, count);
+        if (n < 0 && errno == EINTR)
+            continue;
+        /* a trace that cannot be written must not stop the guest */
+        atomic_store_explicit(&t->tail, n > 0 ? tail + n : head, memory_order_release);
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->drained);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+bool lc3_vm_trace(struct lc3_vm *vm, int fd)
+{
+    if (vm->trace)
+        return false;
+    struct lc3_trace *t = malloc(sizeof(*t));
+    if (t == NULL)
+        return false;
+    t->fd = fd;
+    atomic_init(&t->head, 0);
+    atomic_init(&t->tail, 0);
+    atomic_init(&t->stop, false);
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->drained, NULL);
+    /* the reader starts from zero too */
+    t->next_pc = 0;
+    t->address = 0;
+    if (write(fd, TRACE_MAGIC, strlen(TRACE_MAGIC)) != (ssize_t)strlen(TRACE_MAGIC)
+        || pthread_create(&t->flusher, NULL, trace_flusher, t) != 0)
+    {
+        pthread_mutex_destroy(&t->lock);
+        pthread_cond_destroy(&t->drained);
+        free(t);
+        return false;
+    }
+    vm->trace = t;
+    return true;
+}
+
+/* flush what is left and stop the flusher */
+static void trace_stop(struct lc3_vm *vm)
+{
+    atomic_store_explicit(&vm->trace->stop, true, memory_order_release);
+    pthread_join(vm->trace->flusher, NULL);
+    pthread_mutex_destroy(&vm->trace->lock);
+    pthread_cond_destroy(&vm->trace->drained);
+    free(vm->trace);
+    vm->trace = NULL;
+}
+
+/* 'value' and 'address' are -1 for none */
+static void trace_record(struct lc3_trace *t, uint16_t pc, uint16_t instr, int value, int address)
+{
+    uint8_t record[TRACE_RECORD_MAX];
+    size_t size = 1;
+    uint8_t tag;
+
+    int16_t delta = pc - t->next_pc;
+    if (delta == 0)
+        tag = TRACE_PC_NEXT;
+    else if (delta >= INT8_MIN && delta <= INT8_MAX)
+    {
+        tag = TRACE_PC_NEAR;
+        record[size++] = (uint8_t)delta;
+    }
+    else
+    {
+        tag = TRACE_PC_FAR;
+        record[size++] = pc & 0xFF;
+        record[size++] = pc >> 8;
+    }
+    record[size++] = instr & 0xFF;
+    record[size++] = instr >> 8;
+    if (value >= 0)
+    {
+        tag |= TRACE_VALUE;
+        record[size++] = value & 0xFF;
+        record[size++] = value >> 8;
+    }
+    if (address >= 0)
+    {
+        delta = address - t->address;
+        if (delta >= INT8_MIN && delta <= INT8_MAX)
+        {
+            tag |= TRACE_ADDR_NEAR;
+            record[size++] = (uint8_t)delta;
+        }
+        else
+        {
+            tag |= TRACE_ADDR_FAR;
+            record[size++] = address & 0xFF;
+            record[size++] = address >> 8;
+        }
+        t->address = address;
+    }
+    record[0] = tag;
+    t->next_pc = pc + 1;
+
+    size_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    if (TRACE_RING_SIZE - (head - atomic_load_explicit(&t->tail, memory_order_acquire)) < size)
+    {
+        /* the flusher is behind, which only a slow disk makes it */
+        pthread_mutex_lock(&t->lock);
+        while (TRACE_RING_SIZE - (head - atomic_load_explicit(&t->tail, memory_order_acquire)) < size)
+            pthread_cond_wait(&t->drained, &t->lock);
+        pthread_mutex_unlock(&t->lock);
+    }
+    for (size_t i = 0; i < size; ++i)
+        t->ring[(head + i) & (TRACE_RING_SIZE - 1)] = record[i];
+    atomic_store_explicit(&t->head, head + size, memory_order_release);
+}
+
+/* the data address 'instr' at 'pc' is about to access, -1 for none; the
+ * pointer of LDI/STI is read from memory[] so a device is not polled twice */
+static int trace_address(struct lc3_vm *vm, uint16_t pc, uint16_t instr)
+{
+    uint16_t near = pc + 1 + sign_extend(instr & 0x1FF, 9);
+    switch (instr >> 12)
+    {
+    case OP_LD:
+    case OP_ST:
+        return near;
+    case OP_LDI:
+    case OP_STI:
+        return vm->memory[near];
+    case OP_LDR:
+    case OP_STR:
+        return (uint16_t)(vm->reg[(instr >> 6) & 0x7] + sign_extend(instr & 0x3F, 6));
+    default:
+        return -1;
+    }
+}
+
+/* the register 'instr' wrote, -1 for none */
+static int trace_destination(uint16_t instr)
+{
+    switch (instr >> 12)
+    {
+    case OP_ADD:
+    case OP_AND:
+    case OP_NOT:
+    case OP_LD:
+    case OP_LDI:
+    case OP_LDR:
+    case OP_LEA:
+        return (instr >> 9) & 0x7;
+    case OP_JSR:
+        return R_R7;
+    case OP_TRAP:
+        return (instr & 0xFF) == TRAP_GETC || (instr & 0xFF) == TRAP_IN ? R_R0 : -1;
+    default:
+        return -1;
+    }
+}
+
+/* same contract as run_switch(), one instruction of it at a time with a
+ * record of each */
+static void run_traced(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+
+    while (vm->running && left)
+    {
+        uint16_t pc = vm->reg[R_PC];
+        uint16_t instr = vm->memory[pc];
+        int address = trace_address(vm, pc, instr);
+
+        run_switch(vm, 1);
+        --left;
+        /* a GETC or IN that yielded runs again */
+        if (!vm->running && vm->exit_reason == EXIT_INPUT_TRAP)
+            break;
+        int destination = trace_destination(instr);
+        trace_record(vm->trace, pc, instr, destination >= 0 ? vm->reg[destination] : -1, address);
+    }
+    vm->instr_count = budget - left;
+}
+
+
+/* same contract as run_switch(), but only up to the first flag-setting op:
+ * until then no BR branches, which the cores cannot tell from a zero
+ * reg[R_COND], so these first instructions go one at a time */
+static void run_unflagged(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t budget = limit ? limit : UINT64_MAX;
+    uint64_t left = budget;
+
+    while (vm->running && left && !vm->cond_set)
+    {
+        uint16_t pc = vm->reg[R_PC];
+        uint16_t instr = vm->memory[pc];
+        uint16_t op = instr >> 12;
+        if (op == OP_BR)
+        {
+            COUNT(vm, ops[OP_BR]);
+            COUNT(vm, br_not_taken);
+            ++vm->reg[R_PC];
+            --left;
+            if (vm->trace)
+                trace_record(vm->trace, pc, instr, -1, -1);
+            continue;
+        }
+
+        if (vm->trace)
+            run_traced(vm, 1);
+        else
+            run_switch(vm, 1);
+        --left;
+        if (!vm->running && vm->exit_reason == EXIT_INPUT_TRAP)
+            break;
+        vm->cond_set = op == OP_ADD || op == OP_AND || op == OP_NOT || op == OP_LD
+            || op == OP_LDI || op == OP_LDR || op == OP_LEA;
+    }
+    vm->instr_count = budget - left;
+}
+
+/***************************** Lockstep Lanes ********************************/
+/* each step takes the lowest PC among the live lanes and executes that
+ * instruction for every lane sitting on it; lanes that went different ways
+ * at a branch meet again at the lower PC. Register updates are loops over a
+ * whole row with a mask selecting the step's lanes, which the compiler turns
+ * into vector code. Memory, devices and traps go lane by lane. */
+enum { PAGE_WORDS = 1 << PAGE_SHIFT };
+
+static inline uint16_t *lane_word(struct lc3_lanes *l, int lane, uint16_t address)
+{
+    return l->page[lane][address >> PAGE_SHIFT] + (address & (PAGE_WORDS - 1));
+}
+
+/* after a device access or a trap of 'lane': a guest that stopped takes its
+ * lane out of the run, one that yields for input goes on in the next run */
+static inline void lane_check(struct lc3_lanes *l, int lane)
+{
+    struct lc3_vm *guest = l->guest[lane];
+    if (guest->running)
+        return;
+    l->live &= ~(1u << lane);
+    if (guest->exit_reason == LC3_EXIT_INPUT || guest->exit_reason == EXIT_INPUT_TRAP)
+        l->waiting |= 1u << lane;
+}
+
+static inline uint16_t lane_read(struct lc3_lanes *l, int lane, uint16_t address)
+{
+    if (lc3_is_device(address))
+    {
+        /* the idle detector compares the PC of each poll */
+        l->guest[lane]->reg[R_PC] = l->reg[R_PC][lane];
+        uint16_t val = lc3_device_read(l->guest[lane], address);
+        lane_check(l, lane);
+        return val;
+    }
+    return *lane_word(l, lane, address);
+}
+
+/* the first store of a lane into a page of the image gets the lane a copy */
+static void lane_copy_page(struct lc3_lanes *l, int lane, uint16_t address)
+{
+    uint16_t first = address & ~(PAGE_WORDS - 1);
+    uint16_t *copy = malloc(PAGE_WORDS * sizeof(uint16_t));
+    if (copy == NULL)
+    {
+        fprintf(stderr, "out of memory copying page 0x%04x\n", first);
+        exit(1);
+    }
+    memcpy(copy, l->base + first, PAGE_WORDS * sizeof(uint16_t));
+    l->page[lane][address >> PAGE_SHIFT] = copy;
+    ++l->stats.pages_copied;
+}
+
+static inline void lane_write(struct lc3_lanes *l, int lane, uint16_t address, uint16_t val)
+{
+    struct lc3_vm *guest = l->guest[lane];
+    if (lc3_is_device(address))
+    {
+        device_write(guest, address, val);
+        lane_check(l, lane);
+        return;
+    }
+    if (l->page[lane][address >> PAGE_SHIFT] == l->base + (address & ~(PAGE_WORDS - 1)))
+        lane_copy_page(l, lane, address);
+    /* a lane rewriting code that ran has its words checked from then on */
+    if (l->uops[address].kind != UOP_DECODE)
+        l->rewrote_code |= 1u << lane;
+    *lane_word(l, lane, address) = val;
+    ++guest->store_count;
+}
+
+static void lane_trap(struct lc3_lanes *l, int lane, uint16_t instr)
+{
+    struct lc3_vm *guest = l->guest[lane];
+    switch (instr & 0xFF)
+    {
+    case TRAP_PUTS:
+    case TRAP_PUTSP:
+        /* the string is in the lane's memory, not in the guest's */
+        for (uint16_t address = l->reg[R_R0][lane]; *lane_word(l, lane, address); ++address)
+        {
+            uint16_t word = *lane_word(l, lane, address);
+            output_char(guest, (char)word);
+            if ((instr & 0xFF) == TRAP_PUTSP && (word >> 8))
+                output_char(guest, word >> 8);
+        }
+        ++guest->output_stats.requests;
+        break;
+    default:
+        /* a GETC or IN that yields backs up the PC to run again */
+        guest->reg[R_R0] = l->reg[R_R0][lane];
+        guest->reg[R_PC] = l->reg[R_PC][lane];
+        lc3_op_trap(guest, instr);
+        l->reg[R_R0][lane] = guest->reg[R_R0];
+        l->reg[R_PC][lane] = guest->reg[R_PC];
+        lane_check(l, lane);
+        break;
+    }
+}
+
+/* dst = val in the lanes of 'mask' */
+static inline void lanes_blend(uint16_t *restrict dst, const uint16_t *restrict val,
+                               const uint16_t *restrict mask)
+{
+    for (int i = 0; i < LANE_COUNT; ++i)
+        dst[i] = (dst[i] & ~mask[i]) | (val[i] & mask[i]);
+}
+
+/* register r = val in the lanes of 'mask', and the result for the condition codes */
+static inline void lanes_set(struct lc3_lanes *l, int r, const uint16_t *restrict val,
+                             const uint16_t *restrict mask)
+{
+    lanes_blend(l->reg[r], val, mask);
+    lanes_blend(l->reg[R_COND], val, mask);
+    if (l->unflagged)
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                l->unflagged &= ~(1u << i);
+}
+
+/* the step of 'u' for the lanes of 'mask', whose PCs already point past it */
+static void lanes_execute(struct lc3_lanes *l, const struct uop *u, const uint16_t *mask)
+{
+    _Alignas(32) uint16_t val[LANE_COUNT];
+    uint16_t *pc_row = l->reg[R_PC];
+
+    switch (u->kind)
+    {
+    case UOP_BR:
+    {
+        const uint16_t *cond = l->reg[R_COND];
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = (lc3_flags(cond[i]) & u->r0) ? u->imm : pc_row[i];
+        if (l->unflagged)
+            for (int i = 0; i < LANE_COUNT; ++i)
+                if ((l->unflagged >> i) & 1)
+                    val[i] = pc_row[i];
+        lanes_blend(pc_row, val, mask);
+        break;
+    }
+    case UOP_ADD:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = l->reg[u->r1][i] + l->reg[u->r2][i];
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_ADDI:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = l->reg[u->r1][i] + u->imm;
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_AND:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = l->reg[u->r1][i] & l->reg[u->r2][i];
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_ANDI:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = l->reg[u->r1][i] & u->imm;
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_NOT:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = ~l->reg[u->r1][i];
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_LEA:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = u->imm;
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_JMP:
+        lanes_blend(pc_row, l->reg[u->r1], mask);
+        break;
+    case UOP_JSR:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            val[i] = u->imm;
+        lanes_blend(l->reg[R_R7], pc_row, mask);
+        lanes_blend(pc_row, val, mask);
+        break;
+    case UOP_JSRR:
+        memcpy(val, l->reg[u->r1], sizeof(val));
+        lanes_blend(l->reg[R_R7], pc_row, mask);
+        lanes_blend(pc_row, val, mask);
+        break;
+    case UOP_LD:
+    case UOP_LD_DEVICE:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                val[i] = lane_read(l, i, u->imm);
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_LDI:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                val[i] = lane_read(l, i, lane_read(l, i, u->imm));
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_LDR:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                val[i] = lane_read(l, i, l->reg[u->r1][i] + u->imm);
+        lanes_set(l, u->r0, val, mask);
+        break;
+    case UOP_ST:
+    case UOP_ST_DEVICE:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                lane_write(l, i, u->imm, l->reg[u->r0][i]);
+        break;
+    case UOP_STI:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                lane_write(l, i, lane_read(l, i, u->imm), l->reg[u->r0][i]);
+        break;
+    case UOP_STR:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                lane_write(l, i, l->reg[u->r1][i] + u->imm, l->reg[u->r0][i]);
+        break;
+    case UOP_TRAP:
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+                lane_trap(l, i, u->instr);
+        break;
+    default:
+        /* an illegal opcode only stops its own lanes */
+        for (int i = 0; i < LANE_COUNT; ++i)
+            if (mask[i])
+            {
+                l->guest[i]->reg[R_PC] = pc_row[i];
+                lc3_op_illegal(l->guest[i]);
+                lane_check(l, i);
+            }
+        break;
+    }
+}
+
+/* one lane by itself, a register update and the result for its condition codes */
+static inline void lane_set(struct lc3_lanes *l, int lane, int r, uint16_t val)
+{
+    l->reg[r][lane] = val;
+    l->reg[R_COND][lane] = val;
+    l->unflagged &= ~(1u << lane);
+}
+
+/* run 'lane' alone while its PC stays below 'stop', the lowest PC of the
+ * other lanes; these are the steps lc3_lanes_run() would take with no other
+ * lane on them, without setting up masks for each. Executes at least one
+ * and at most 'budget' instructions, returns how many. */
+static uint64_t lane_solo(struct lc3_lanes *l, int lane, uint32_t stop, uint64_t budget)
+{
+#define R(r) l->reg[r][lane]
+    uint64_t done = 0;
+    do
+    {
+        uint16_t pc = R(R_PC)++;
+        uint16_t instr = *lane_word(l, lane, pc);
+        struct uop *u = &l->uops[pc];
+        if (u->kind == UOP_DECODE || u->instr != instr)
+            lc3_uop_decode(u, pc, instr);
+        ++done;
+
+        switch (u->kind)
+        {
+        case UOP_BR:
+            if ((u->r0 & lc3_flags(R(R_COND))) && !((l->unflagged >> lane) & 1))
+                R(R_PC) = u->imm;
+            break;
+        case UOP_ADD:
+            lane_set(l, lane, u->r0, R(u->r1) + R(u->r2));
+            break;
+        case UOP_ADDI:
+            lane_set(l, lane, u->r0, R(u->r1) + u->imm);
+            break;
+        case UOP_AND:
+            lane_set(l, lane, u->r0, R(u->r1) & R(u->r2));
+            break;
+        case UOP_ANDI:
+            lane_set(l, lane, u->r0, R(u->r1) & u->imm);
+            break;
+        case UOP_NOT:
+            lane_set(l, lane, u->r0, ~R(u->r1));
+            break;
+        case UOP_LEA:
+            lane_set(l, lane, u->r0, u->imm);
+            break;
+        case UOP_JMP:
+            R(R_PC) = R(u->r1);
+            break;
+        case UOP_JSR:
+            R(R_R7) = R(R_PC);
+            R(R_PC) = u->imm;
+            break;
+        case UOP_JSRR:
+        {
+            uint16_t target = R(u->r1);
+            R(R_R7) = R(R_PC);
+            R(R_PC) = target;
+            break;
+        }
+        case UOP_LD:
+        case UOP_LD_DEVICE:
+            lane_set(l, lane, u->r0, lane_read(l, lane, u->imm));
+            break;
+        case UOP_LDI:
+            lane_set(l, lane, u->r0, lane_read(l, lane, lane_read(l, lane, u->imm)));
+            break;
+        case UOP_LDR:
+            lane_set(l, lane, u->r0, lane_read(l, lane, R(u->r1) + u->imm));
+            break;
+        case UOP_ST:
+        case UOP_ST_DEVICE:
+            lane_write(l, lane, u->imm, R(u->r0));
+            break;
+        case UOP_STI:
+            lane_write(l, lane, lane_read(l, lane, u->imm), R(u->r0));
+            break;
+        case UOP_STR:
+            lane_write(l, lane, R(u->r1) + u->imm, R(u->r0));
+            break;
+        case UOP_TRAP:
+            lane_trap(l, lane, u->instr);
+            break;
+        default:
+            l->guest[lane]->reg[R_PC] = R(R_PC);
+            lc3_op_illegal(l->guest[lane]);
+            lane_check(l, lane);
+            break;
+        }
+    } while (done < budget && ((l->live >> lane) & 1) && R(R_PC) < stop);
+#undef R
+    return done;
+}
+
+uint64_t lc3_lanes_run(struct lc3_lanes *l, uint64_t steps)
+{
+    uint64_t budget = steps ? steps : UINT64_MAX;
+    uint64_t left = budget;
+    uint64_t retired = 0;
+    _Alignas(32) uint16_t mask[LANE_COUNT];
+    _Alignas(32) uint16_t live_mask[LANE_COUNT];
+    uint16_t *pc_row = l->reg[R_PC];
+
+    l->live = 0;
+    l->waiting = 0;
+    for (int lane = 0; lane < l->count; ++lane)
+    {
+        struct lc3_vm *guest = l->guest[lane];
+        if (!guest->started)
+        {
+            guest->started = true;
+            guest->output.line_flush = guest->output.fd >= 0 && isatty(guest->output.fd);
+            input_init(guest);
+        }
+        if (guest->running && (!l->limit || l->retired[lane] < l->limit))
+            l->live |= 1u << lane;
+    }
+
+    uint32_t seen = 0;          /* l->live when live_mask was built */
+    int live_count = 0;
+    int first = 0;              /* lowest live lane */
+    bool uniform = false;       /* every live lane is at the same PC */
+    uint64_t until_limit = 0;   /* steps before some lane can reach the limit */
+
+    while (l->live && left)
+    {
+        if (l->live != seen || (l->limit && until_limit == 0))
+        {
+            if (l->limit && until_limit == 0)
+            {
+                until_limit = UINT64_MAX;
+                for (int i = 0; i < l->count; ++i)
+                    if ((l->live >> i) & 1)
+                    {
+                        if (l->retired[i] >= l->limit)
+                            l->live &= ~(1u << i);
+                        else if (l->limit - l->retired[i] < until_limit)
+                            until_limit = l->limit - l->retired[i];
+                    }
+                if (!l->live)
+                    break;
+            }
+            seen = l->live;
+            live_count = 0;
+            for (int i = 0; i < LANE_COUNT; ++i)
+            {
+                live_mask[i] = ((seen >> i) & 1) ? 0xFFFF : 0;
+                live_count += (seen >> i) & 1;
+            }
+            for (first = 0; !((seen >> first) & 1); ++first)
+                ;
+        }
+        uint16_t pc;
+        int count;
+        int leader;
+        if (uniform)
+        {
+            pc = pc_row[first];
+            leader = first;
+            memcpy(mask, live_mask, sizeof(mask));
+            count = live_count;
+        }
+        else
+        {
+            /* the lowest PC goes first */
+            pc = UINT16_MAX;
+            for (int i = 0; i < LANE_COUNT; ++i)
+            {
+                uint16_t key = pc_row[i] | ~live_mask[i];
+                pc = key < pc ? key : pc;
+            }
+            count = 0;
+            for (int i = 0; i < LANE_COUNT; ++i)
+            {
+                mask[i] = live_mask[i] & (pc_row[i] == pc ? 0xFFFF : 0);
+                count += mask[i] & 1;
+            }
+            for (leader = first; !mask[leader]; ++leader)
+                ;
+        }
+
+        uint16_t instr = *lane_word(l, leader, pc);
+        struct uop *cached = &l->uops[pc];
+        uint32_t check = l->rewrote_code;
+        if (cached->kind == UOP_DECODE || cached->instr != instr)
+        {
+            lc3_uop_decode(cached, pc, instr);
+            check = seen;
+        }
+        /* a copy, the row loops below would have to reload it after every store */
+        const struct uop op = *cached;
+        const struct uop *u = &op;
+        /* lanes whose word at pc differs wait for a step of their own */
+        if (check & seen)
+            for (int i = 0; i < LANE_COUNT; ++i)
+                if (mask[i] && ((check >> i) & 1) && *lane_word(l, i, pc) != instr)
+                {
+                    mask[i] = 0;
+                    --count;
+                }
+
+        if (count == 1)
+        {
+            uint32_t stop = UINT16_MAX + 1;
+            for (int i = 0; i < LANE_COUNT; ++i)
+                if (i != leader && live_mask[i] && pc_row[i] < stop)
+                    stop = pc_row[i];
+            uint64_t budget = l->limit && until_limit < left ? until_limit : left;
+            uint64_t done = lane_solo(l, leader, stop, budget);
+            left -= done;
+            if (l->limit)
+                until_limit -= done;
+            l->retired[leader] += done;
+            retired += done;
+            uniform = false;
+            continue;
+        }
+        --left;
+        if (l->limit)
+            --until_limit;
+
+        for (int i = 0; i < LANE_COUNT; ++i)
+            pc_row[i] += mask[i] & 1;
+
+        lanes_execute(l, u, mask);
+
+        for (int i = 0; i < LANE_COUNT; ++i)
+            l->retired[i] += mask[i] & 1;
+        retired += count;
+
+        /* still together if the step took every lane and they went the same way */
+        uniform = count == live_count;
+        if (uniform && (u->kind == UOP_BR || u->kind == UOP_JMP || u->kind == UOP_JSRR))
+        {
+            uint16_t apart = 0;
+            for (int i = 0; i < LANE_COUNT; ++i)
+                apart |= (pc_row[i] ^ pc_row[leader]) & live_mask[i];
+            uniform = !apart;
+        }
+    }
+
+    /* as in lc3_vm_run(), a TRAP that yielded did not retire */
+    for (int lane = 0; lane < l->count; ++lane)
+        if ((l->waiting >> lane) & 1)
+        {
+            struct lc3_vm *guest = l->guest[lane];
+            if (guest->exit_reason == EXIT_INPUT_TRAP)
+            {
+                --l->retired[lane];
+                --retired;
+            }
+            guest->running = true;
+            guest->exit_reason = LC3_EXIT_HALTED;
+        }
+    l->stats.steps += budget - left;
+    l->stats.instructions += retired;
+    return retired;
+}
+
+
+/******************************** Snapshots **********************************/
+static atomic_uint_fast64_t snapshot_ids;
+
+/* put back the words of 'page' that differ from the snapshot, dropping
+ * whatever was decoded or translated from the old ones */
+static void snapshot_restore_page(struct lc3_vm *vm, const struct lc3_snapshot *snap, int page)
+{
+    uint32_t first = page << PAGE_SHIFT;
+    for (uint32_t address = first; address < first + (1 << PAGE_SHIFT); ++address)
+        if (vm->memory[address] != snap->memory[address])
+        {
+            vm->memory[address] = snap->memory[address];
+            code_invalidate(vm, address);
+        }
+}
+
+struct lc3_snapshot *lc3_vm_snapshot(struct lc3_vm *vm)
+{
+    struct lc3_snapshot *snap = malloc(sizeof(*snap));
+    if (snap == NULL)
+        return NULL;
+
+    /* a restore rewinds the log being recorded to here */
+    snap->replay_mode = vm->replay.mode;
+    if (vm->replay.mode == REPLAY_RECORD)
+    {
+        snap->replay_offset = fflush(vm->replay.file) == 0 ? ftell(vm->replay.file) : -1;
+        if (snap->replay_offset < 0)
+        {
+            free(snap);
+            return NULL;
+        }
+        snap->replay_last = vm->replay.last;
+    }
+    snap->replay_next = vm->replay.next;
+    snap->replay_used = vm->replay.used;
+    snap->replay_played = vm->replay.played;
+    /* the output so far was printed before the snapshot */
+    output_flush(vm);
+
+    snap->id = atomic_fetch_add(&snapshot_ids, 1) + 1;
+    memcpy(snap->memory, vm->memory, sizeof(snap->memory));
+    memcpy(snap->reg, vm->reg, sizeof(snap->reg));
+    snap->cond_set = vm->cond_set;
+    snap->running = vm->running;
+    snap->exit_reason = vm->exit_reason;
+    snap->timer_left = vm->timer_due - lc3_now_seconds();
+
+    snap->input_kept = !vm->input.threaded;
+    snap->input_pending = 0;
+    if (snap->input_kept)
+    {
+        size_t tail = atomic_load(&vm->input.tail);
+        size_t head = atomic_load(&vm->input.head);
+        for (size_t i = tail; i != head; ++i)
+            snap->input_ring[snap->input_pending++] = vm->input.ring[i & (INPUT_RING_SIZE - 1)];
+        snap->input_eof = atomic_load(&vm->input.eof);
+        snap->input_offset = vm->input.fd < 0 ? (off_t)vm->input.keys_taken
+                                              : lseek(vm->input.fd, 0, SEEK_CUR);
+    }
+
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->dirty_since = snap->id;
+    return snap;
+}
+
+void lc3_vm_restore(struct lc3_vm *vm, const struct lc3_snapshot *snap)
+{
+    /* the device page is small and not tracked, it always goes back */
+    bool every_page = vm->dirty_since != snap->id;
+    for (int page = 0; page < PAGE_COUNT; ++page)
+        if (every_page || vm->dirty[page] || page == DEVICE_BASE >> PAGE_SHIFT)
+            snapshot_restore_page(vm, snap, page);
+    memset(vm->dirty, 0, sizeof(vm->dirty));
+    vm->dirty_since = snap->id;
+
+    memcpy(vm->reg, snap->reg, sizeof(vm->reg));
+    vm->cond_set = snap->cond_set;
+    vm->running = snap->running;
+    vm->exit_reason = snap->exit_reason;
+    vm->timer_due = lc3_now_seconds() + snap->timer_left;
+    vm->idle.polls = 0;
+
+    /* what the guest printed since stays printed */
+    output_flush(vm);
+
+    /* readings recorded since are dropped, a replay feeds the ones after the
+     * snapshot again, even when it has diverged or ended since */
+    if (snap->replay_mode == REPLAY_RECORD && vm->replay.mode == REPLAY_RECORD)
+    {
+        fflush(vm->replay.file);
+        if (ftruncate(fileno(vm->replay.file), snap->replay_offset) == 0)
+            fseek(vm->replay.file, snap->replay_offset, SEEK_SET);
+        vm->replay.last = snap->replay_last;
+    }
+    else if (snap->replay_mode == REPLAY_PLAY && vm->replay.events)
+    {
+        vm->replay.next = snap->replay_next;
+        vm->replay.used = snap->replay_used;
+        vm->replay.played = snap->replay_played;
+        vm->replay.mode = REPLAY_PLAY;
+    }
+
+    if (snap->input_kept && !vm->input.threaded)
+    {
+        memcpy(vm->input.ring, snap->input_ring, snap->input_pending);
+        atomic_store(&vm->input.tail, 0);
+        atomic_store(&vm->input.head, snap->input_pending);
+        atomic_store(&vm->input.eof, snap->input_eof);
+        if (vm->input.fd < 0)
+            vm->input.keys_taken = snap->input_offset;
+        else if (snap->input_offset >= 0)
+            lseek(vm->input.fd, snap->input_offset, SEEK_SET);
+    }
+}
+
+void lc3_snapshot_destroy(struct lc3_snapshot *snap)
+{
+    free(snap);
+}
+
+
+/****************************** Shared Images ********************************/
+_Static_assert(offsetof(struct lc3_vm, memory) == 0, "memory[] is mapped at the start of the VM");
+
+enum { IMAGE_BYTES = (UINT16_MAX + 1) * sizeof(uint16_t) };
+
+struct lc3_image *lc3_image_load(const char *image_path)
+{
+    FILE *file = fopen(image_path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    struct lc3_image *image = malloc(sizeof(*image));
+    uint16_t *memory = MAP_FAILED;
+    int fd = memfd_create("lc3-image", MFD_CLOEXEC);
+    if (image && fd >= 0 && ftruncate(fd, IMAGE_BYTES) == 0)
+        memory = mmap(NULL, IMAGE_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (memory == MAP_FAILED)
+    {
+        if (fd >= 0)
+            close(fd);
+        free(image);
+        fclose(file);
+        return NULL;
+    }
+
+    image->fd = fd;
+    image->count = read_image_words(memory, file, &image->origin);
+    munmap(memory, IMAGE_BYTES);
+    fclose(file);
+    return image;
+}
+
+void lc3_image_destroy(struct lc3_image *image)
+{
+    close(image->fd);
+    free(image);
+}
+
+bool lc3_vm_map_image(struct lc3_vm *vm, const struct lc3_image *image)
+{
+    if (vm->started)
+        return false;
+
+    /* the host pages below the device page come from the image. The last
+     * one holding device registers stays the guest's own: devices_init()
+     * set MCR in it and every KBSR or DSR read writes it, so sharing it
+     * would only cost each guest a copy-on-write fault. */
+    size_t host_page = sysconf(_SC_PAGESIZE);
+    size_t shared = DEVICE_BASE * sizeof(uint16_t) / host_page * host_page;
+    size_t first = shared / sizeof(uint16_t);
+
+    /* read the rest before memory[] changes, so a failure leaves the guest as it was */
+    uint16_t *tail = malloc(IMAGE_BYTES - shared);
+    if (tail == NULL)
+        return false;
+    if (pread(image->fd, tail, IMAGE_BYTES - shared, shared) != (ssize_t)(IMAGE_BYTES - shared)
+        || mmap(vm->memory, shared, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, image->fd, 0) == MAP_FAILED)
+    {
+        free(tail);
+        return false;
+    }
+
+    /* device registers keep their state except where the image landed */
+    for (uint32_t address = first; address <= UINT16_MAX; ++address)
+        if (address < DEVICE_BASE || address - image->origin < image->count)
+            vm->memory[address] = tail[address - first];
+    free(tail);
+    return true;
+}
+
+
+/********************************* Library ***********************************/
+struct lc3_vm *lc3_vm_create()
+{
+    struct lc3_vm *vm = mmap(NULL, sizeof(*vm), PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm == MAP_FAILED)
+        return NULL;
+
+    vm->core = CORE_DEFAULT;
+    vm->running = true;
+    vm->reg[R_PC] = PC_START;
+    vm->output.fd = STDOUT_FILENO;
+    vm->output.size = OUTPUT_BUFFER_DEFAULT;
+    vm->input.fd = STDIN_FILENO;
+    pthread_mutex_init(&vm->input.lock, NULL);
+    pthread_cond_init(&vm->input.ready, NULL);
+    pthread_cond_init(&vm->input.space, NULL);
+    devices_init(vm);
+    return vm;
+}
+
+void lc3_vm_destroy(struct lc3_vm *vm)
+{
+    replay_finish(vm);
+    if (vm->trace)
+        trace_stop(vm);
+    if (vm->input.threaded)
+    {
+        /* a reader cancelled while it waits for space gives the lock back */
+        pthread_cancel(vm->input.reader);
+        pthread_join(vm->input.reader, NULL);
+    }
+    output_flush(vm);
+
+    block_reap(vm);
+    while (vm->block_list)
+    {
+        struct block *b = vm->block_list;
+        vm->block_list = b->next;
+        free(b);
+    }
+#ifdef LC3_HAVE_JIT
+    if (vm->jit_code)
+        munmap(vm->jit_code, vm->jit_size);
+#endif
+    pthread_mutex_destroy(&vm->input.lock);
+    pthread_cond_destroy(&vm->input.ready);
+    pthread_cond_destroy(&vm->input.space);
+    free(vm->output.capture);
+    munmap(vm, sizeof(*vm));
+}
+
+struct lc3_lanes *lc3_lanes_create(int count)
+{
+    if (count < 1 || count > LANE_COUNT)
+        return NULL;
+    struct lc3_lanes *l = aligned_alloc(_Alignof(struct lc3_lanes), sizeof(*l));
+    if (l == NULL)
+        return NULL;
+    memset(l, 0, sizeof(*l));
+
+    l->count = count;
+    l->unflagged = (1u << count) - 1;
+    for (int lane = 0; lane < count; ++lane)
+    {
+        l->guest[lane] = lc3_vm_create();
+        if (l->guest[lane] == NULL)
+        {
+            lc3_lanes_destroy(l);
+            return NULL;
+        }
+        for (int page = 0; page < PAGE_COUNT; ++page)
+            l->page[lane][page] = l->base + (page << PAGE_SHIFT);
+        l->page[lane][DEVICE_BASE >> PAGE_SHIFT] = l->guest[lane]->memory + DEVICE_BASE;
+        l->reg[R_PC][lane] = PC_START;
+    }
+    return l;
+}
+
+void lc3_lanes_destroy(struct lc3_lanes *l)
+{
+    for (int lane = 0; lane < l->count && l->guest[lane]; ++lane)
+    {
+        for (int page = 0; page < PAGE_COUNT; ++page)
+            if (page != DEVICE_BASE >> PAGE_SHIFT && l->page[lane][page] != l->base + (page << PAGE_SHIFT))
+                free(l->page[lane][page]);
+        lc3_vm_destroy(l->guest[lane]);
+    }
+    free(l);
+}
+
+/* load before the first run, a page a lane has copied keeps its old words */
+bool lc3_lanes_load(struct lc3_lanes *l, const char *image_path)
+{
+    FILE *image_file = fopen(image_path, "rb");
+    if (image_file == NULL)
+        return false;
+    uint16_t origin;
+    size_t count = read_image_words(l->base, image_file, &origin);
+    fclose(image_file);
+
+    /* what lands on the device page goes into every guest, like read_image() */
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint16_t address = origin + i;
+        if (address >= DEVICE_BASE)
+            for (int lane = 0; lane < l->count; ++lane)
+                l->guest[lane]->memory[address] = l->base[address];
+    }
+    return true;
+}
+
+bool lc3_vm_set_core(struct lc3_vm *vm, const char *name)
+{
+    for (int core = 0; core < CORE_COUNT; ++core)
+        if (strcmp(name, core_names[core]) == 0)
+        {
+            vm->core = core;
+            return true;
+        }
+    return false;
+}
+
+bool lc3_vm_load(struct lc3_vm *vm, const char *image_path)
+{
+    return read_image(vm, image_path);
+}
+
+bool lc3_vm_set_input(struct lc3_vm *vm, const void *keys, size_t size)
+{
+    if (vm->started)
+        return false;
+    vm->input.fd = -1;
+    vm->input.keys = keys;
+    vm->input.keys_size = size;
+    vm->input.keys_taken = 0;
+    return true;
+}
+
+bool lc3_vm_capture_output(struct lc3_vm *vm)
+{
+    if (vm->started)
+        return false;
+    vm->output.fd = -1;
+    return true;
+}
+
+/* everything the guest printed so far, not NUL-terminated */
+const char *lc3_vm_output(struct lc3_vm *vm, size_t *size)
+{
+    output_flush(vm);
+    *size = vm->output.captured;
+    return vm->output.capture;
+}
+
+#ifdef LC3_COUNTERS
+void lc3_vm_dump_counters(struct lc3_vm *vm, FILE *file)
+{
+    static const char *const op_names[16] = {
+        "br", "add", "ld", "st", "jsr", "and", "ldr", "str",
+        "rti", "not", "ldi", "sti", "jmp", "res", "lea", "trap"
+    };
+    uint64_t instructions = 0;
+    for (int op = 0; op < 16; ++op)
+        instructions += vm->counters.ops[op];
+    uint64_t loads = vm->counters.ops[OP_LD] + vm->counters.ops[OP_LDI] + vm->counters.ops[OP_LDR];
+    uint64_t stores = vm->counters.ops[OP_ST] + vm->counters.ops[OP_STI] + vm->counters.ops[OP_STR];
+
+    fprintf(file, "{\"instructions\": %llu, \"ops\": {", (unsigned long long)instructions);
+    for (int op = 0; op < 16; ++op)
+        fprintf(file, "%s\"%s\": %llu", op ? ", " : "", op_names[op],
+                (unsigned long long)vm->counters.ops[op]);
+    fprintf(file, "}, \"traps\": {");
+    bool first = true;
+    for (int vector = 0; vector < 256; ++vector)
+    {
+        if (vm->counters.traps[vector] == 0)
+            continue;
+        fprintf(file, "%s\"x%02x\": %llu", first ? "" : ", ", vector,
+                (unsigned long long)vm->counters.traps[vector]);
+        first = false;
+    }
+    fprintf(file, "}, \"branches\": {\"taken\": %llu, \"not_taken\": %llu}, "
+            "\"memory\": {\"loads\": %llu, \"stores\": %llu}, "
+            "\"devices\": {\"reads\": %llu, \"writes\": %llu}}\n",
+            (unsigned long long)vm->counters.br_taken,
+            (unsigned long long)vm->counters.br_not_taken,
+            (unsigned long long)loads, (unsigned long long)stores,
+            (unsigned long long)vm->counters.device_reads,
+            (unsigned long long)vm->counters.device_writes);
+}
+#endif
+
+static void run_core(struct lc3_vm *vm, uint64_t limit)
+{
+    /* a traced guest runs one instruction at a time, whatever its core */
+    if (vm->trace)
+        run_traced(vm, limit);
+    else
+    {
+        switch (vm->core)
+        {
+        case CORE_SWITCH:
+            run_switch(vm, limit);
+            break;
+        case CORE_THREADED:
+            run_threaded(vm, limit);
+            break;
+        case CORE_DECODED:
+            run_decoded(vm, limit);
+            break;
+        case CORE_BLOCK:
+        case CORE_JIT:
+            run_blocks(vm, limit);
+            break;
+#ifdef LC3_AOT
+        case CORE_AOT:
+            run_aot(vm, limit);
+            break;
+#endif
+        }
+    }
+}
+
+enum lc3_exit lc3_vm_run(struct lc3_vm *vm, uint64_t limit)
+{
+    if (!vm->started)
+    {
+        vm->started = true;
+        vm->output.line_flush = vm->output.fd >= 0 && isatty(vm->output.fd);
+        input_init(vm);
+#ifdef LC3_HAVE_JIT
+        if (vm->core == CORE_JIT && !jit_init(vm))
+            fprintf(stderr, "cannot map executable memory, running without the JIT\n");
+#endif
+    }
+
+    /* the cores take over once the guest has set its flags */
+    uint64_t unflagged = 0;
+    if (!vm->cond_set)
+    {
+        run_unflagged(vm, limit);
+        unflagged = vm->instr_count;
+    }
+    vm->instr_count = 0;
+    if (vm->running && (!limit || unflagged < limit))
+        run_core(vm, limit ? limit - unflagged : 0);
+    vm->instr_count += unflagged;
+
+    if (vm->running)
+        return LC3_EXIT_QUANTUM;
+    switch (vm->exit_reason)
+    {
+    case EXIT_INPUT_TRAP:
+        --vm->instr_count;
+#ifdef LC3_COUNTERS
+        /* nor did the trap happen */
+        --vm->counters.ops[OP_TRAP];
+        --vm->counters.traps[vm->memory[vm->reg[R_PC]] & 0xFF];
+#endif
+        /* fall through */
+    case LC3_EXIT_INPUT:
+        /* the next run picks up where this one stopped */
+        vm->running = true;
+        vm->exit_reason = LC3_EXIT_HALTED;
+        return LC3_EXIT_INPUT;
+    default:
+        return vm->exit_reason;
+    }
+}
+
+
+/*****************************************************************************/
+#ifndef LC3_NO_MAIN
+/* instructions between samples, prime so that loops do not alias with it */
+enum { PROFILE_PERIOD_DEFAULT = 9973 };
+
+static struct termios original_tio;
+
+/* the guest of lc3_vm's own main(), whose output an interrupt flushes */
+static struct lc3_vm *interrupt_vm;
+
+static void disable_input_buffering()
+{
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
+
+static void restore_input_buffering()
+{
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+
+/* nothing here is safe to call from a handler, main() stops the guest
+ * and shuts down as usual once it sees the flag */
+static void handle_interrupt(int signal)
+{
+    (void)signal;
+    if (interrupt_vm)
+        interrupt_vm->interrupted = 1;
+}
+
+static void usage(const char *prog)
+{
+#ifdef LC3_AOT
+    fprintf(stderr, "usage: %s [-c core] [-n count] [-b bytes] [-s] [-H] [-i input] [-o output] [-t trace]\n"
+            "       [-e log | -E log]\n"
+            "       [-p profile [-r period] [-S symbols]] [-F requests] [image-file...]\n", prog);
+#else
+    fprintf(stderr, "usage: %s [-c core] [-n count] [-b bytes] [-s] [-H] [-i input] [-o output] [-t trace]\n"
+            "       [-e log | -E log]\n"
+            "       [-p profile [-r period] [-S symbols]] [-F requests] image-file...\n", prog);
+#endif
+    fprintf(stderr, "  -c core   interpreter core:");
+    for (int core = 0; core < CORE_COUNT; ++core)
+        fprintf(stderr, " %s", core_names[core]);
+    fprintf(stderr, " (default: %s)\n"
+            "  -n count  stop after 'count' instructions\n"
+            "  -b bytes  output buffer size, 1 writes every byte (default: %d)\n"
+            "  -s        print execution statistics to stderr on exit\n"
+            "  -H        headless: leave the terminal and SIGINT alone\n"
+            "  -i input  read keys from the file 'input', implies -H\n"
+            "  -o output write the guest's output to the file 'output'\n"
+            "  -e log    record every keyboard and timer reading of the guest to 'log'\n"
+            "  -E log    replay the readings of 'log' instead of the keyboard and timer\n"
+            "  -t file   write a binary trace of every instruction to 'file', see lc3_trace\n"
+            "  -p file   sample the guest PC, write the samples to 'file' in folded format\n"
+            "  -r period sample every 'period' instructions, or 'period'hz of CPU time (default: %d)\n"
+            "  -S file   label samples from this symbol table (default: the image's .sym)\n"
+            "  -F file   fork server: run the loaded guest once per 'input output' line of 'file',\n"
+            "            not with -i, -o, -e, -E, -t or -p\n",
+            core_names[CORE_DEFAULT], OUTPUT_BUFFER_DEFAULT, PROFILE_PERIOD_DEFAULT);
+#ifdef LC3_COUNTERS
+    fprintf(stderr, "  -j file   write the execution counters to 'file' as JSON on exit, - for stderr\n");
+#endif
+}
+
+/******************************** Profiler ***********************************/
+/* samples of reg[R_PC] by address; the block cores only set R_PC between
+ * blocks, so on them a sample lands on the entry of the running block */
+static uint64_t profile_samples[UINT16_MAX + 1];
+static struct lc3_vm *profile_vm;
+
+/* labels from the assembler's symbol table, by address */
+struct symbol {
+    uint16_t address;
+    char name[64];
+};
+static struct symbol *symbols;
+static size_t symbol_count;
+
+static int symbol_compare(const void *a, const void *b)
+{
+    return (int)((const struct symbol *)a)->address - (int)((const struct symbol *)b)->address;
+}
+
+/* read a .sym file, whose entries are lines of a label and its address in
+ * hex behind "//"; everything else in it is skipped */
+static bool symbols_load(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    char line[256];
+    size_t size = 0;
+    bool ok = true;
+    while (fgets(line, sizeof(line), file))
+    {
+        const char *p = line;
+        while (*p == '/' || *p == ' ' || *p == '\t')
+            ++p;
+        struct symbol sym;
+        char address[16];
+        char rest;
+        if (sscanf(p, "%63s %15s %c", sym.name, address, &rest) != 2)
+            continue;
+        char *end;
+        unsigned long value = strtoul(address, &end, 16);
+        if (*end != '\0' || !isxdigit((unsigned char)address[0]) || value > UINT16_MAX)
+            continue;
+        sym.address = value;
+
+        if (symbol_count == size)
+        {
+            size = size ? 2 * size : 64;
+            struct symbol *grown = realloc(symbols, size * sizeof(*symbols));
+            if (grown == NULL)
+            {
+                ok = false;
+                break;
+            }
+            symbols = grown;
+        }
+        symbols[symbol_count++] = sym;
+    }
+    if (ferror(file))
+        ok = false;
+    fclose(file);
+    qsort(symbols, symbol_count, sizeof(*symbols), symbol_compare);
+    return ok;
+}
+
+/* the label at or before 'address', NULL without one */
+static const struct symbol *symbol_find(uint16_t address)
+{
+    size_t low = 0;
+    size_t high = symbol_count;
+    while (low < high)
+    {
+        size_t mid = (low + high) / 2;
+        if (symbols[mid].address <= address)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low ? &symbols[low - 1] : NULL;
+}
+
+static void profile_tick(int signal)
+{
+    (void)signal;
+    ++profile_samples[profile_vm->reg[R_PC]];
+}
+
+/* sample on SIGPROF, 'hz' times per second of CPU time */
+static bool profile_start_timer(struct lc3_vm *vm, long hz)
+{
+    profile_vm = vm;
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profile_tick;
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, NULL);
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = hz < 1000000 ? 1000000 / hz : 1;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+static void profile_stop_timer(void)
+{
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+/* lc3_vm_run() in slices of 'period' instructions with a sample after each;
+ * leaves the instructions of all slices in instr_count */
+static enum lc3_exit profile_run(struct lc3_vm *vm, uint64_t limit, uint64_t period)
+{
+    uint64_t total = 0;
+    enum lc3_exit reason;
+    do
+    {
+        uint64_t slice = limit && limit - total < period ? limit - total : period;
+        reason = lc3_vm_run(vm, slice);
+        total += vm->instr_count;
+        if (reason == LC3_EXIT_QUANTUM)
+            ++profile_samples[vm->reg[R_PC]];
+    } while (reason == LC3_EXIT_QUANTUM && !vm->interrupted && (!limit || total < limit));
+    vm->instr_count = total;
+    return reason;
+}
+
+/* instructions a run goes on for after a SIGINT, at most */
+enum { INTERRUPT_SLICE = 1 << 20 };
+
+/* lc3_vm_run() in slices until the guest stops or SIGINT arrives; leaves
+ * the instructions of all slices in instr_count */
+static enum lc3_exit interruptible_run(struct lc3_vm *vm, uint64_t limit)
+{
+    uint64_t total = 0;
+    enum lc3_exit reason;
+    do
+    {
+        uint64_t slice = limit && limit - total < INTERRUPT_SLICE ? limit - total : INTERRUPT_SLICE;
+        reason = lc3_vm_run(vm, slice);
+        total += vm->instr_count;
+    } while ((reason == LC3_EXIT_QUANTUM || reason == LC3_EXIT_INPUT) && !vm->interrupted
+             && (!limit || total < limit));
+    vm->instr_count = total;
+    return reason;
+}
+
+/* one line per sampled address in the folded format of flamegraph.pl:
+ * the image, the label the address belongs to, then the address itself */
+static bool profile_write(const char *path, const char *image)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    const char *base = strrchr(image, '/');
+    base = base ? base + 1 : image;
+    for (uint32_t address = 0; address <= UINT16_MAX; ++address)
+    {
+        if (profile_samples[address] == 0)
+            continue;
+        const struct symbol *sym = symbol_find(address);
+        if (sym)
+            fprintf(file, "%s;%s;%s+%u %llu\n", base, sym->name, sym->name,
+                    address - sym->address, (unsigned long long)profile_samples[address]);
+        else
+            fprintf(file, "%s;x%04X %llu\n", base, address,
+                    (unsigned long long)profile_samples[address]);
+    }
+    return fclose(file) == 0;
+}
+
+/* what a fork server child hands back to its parent */
+struct fork_result {
+    uint8_t exit_reason;
+    uint64_t instructions;
+};
+
+static const char *const exit_names[LC3_EXIT_COUNT] = {
+    [LC3_EXIT_HALTED] = "halted",
+    [LC3_EXIT_QUANTUM] = "quantum",
+    [LC3_EXIT_INPUT] = "input",
+    [LC3_EXIT_ILLEGAL] = "illegal",
+};
+
+/* the child of one request: the guest as the server loaded it, reading
+ * 'input' ('-' for nothing) and writing 'output' */
+static void fork_child(struct lc3_vm *vm, uint64_t limit, const char *input, const char *output, int result_fd)
+{
+    vm->input.fd = open(strcmp(input, "-") == 0 ? "/dev/null" : input, O_RDONLY);
+    vm->output.fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (vm->input.fd < 0 || vm->output.fd < 0)
+        _exit(2);
+
+    struct fork_result result;
+    result.exit_reason = lc3_vm_run(vm, limit);
+    result.instructions = vm->instr_count;
+    output_flush(vm);
+    const uint8_t *p = (const uint8_t *)&result;
+    size_t left = sizeof(result);
+    while (left)
+    {
+        ssize_t n = write(result_fd, p, left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            _exit(3);
+        p += n;
+        left -= n;
+    }
+    _exit(0);
+}
+
+/* translate the image the way the selected core would, the pages that hold
+ * the translations are then shared by every child */
+static void fork_warm(struct lc3_vm *vm)
+{
+    switch (vm->core)
+    {
+    case CORE_DECODED:
+        for (uint32_t address = 0; address < DEVICE_BASE; ++address)
+            if (vm->memory[address])
+                lc3_uop_decode(&vm->uop_cache[address], address, vm->memory[address]);
+        break;
+    case CORE_BLOCK:
+        block_warm(vm);
+        break;
+    case CORE_JIT:
+        block_warm(vm);
+#ifdef LC3_HAVE_JIT
+        if (jit_init(vm))
+            jit_warm(vm);
+        else
+            fprintf(stderr, "cannot map executable memory, running without the JIT\n");
+#endif
+        break;
+    default:
+        break;
+    }
+}
+
+/* -F: the image is loaded and translated once, every request line read from
+ * 'control' forks a child that starts from there; each gets a line on stdout
+ * with how the guest stopped and the instructions it ran, or "failed" and why */
+static int fork_server(struct lc3_vm *vm, uint64_t limit, const char *control_path)
+{
+    FILE *control = fopen(control_path, "r");
+    if (control == NULL)
+    {
+        fprintf(stderr, "cannot open requests: %s\n", control_path);
+        return 1;
+    }
+    fork_warm(vm);
+
+    char line[8192];
+    char input[4096];
+    char output[4096];
+    while (fgets(line, sizeof(line), control))
+    {
+        if (sscanf(line, "%4095s %4095s", input, output) != 2)
+        {
+            printf("failed request\n");
+            fflush(stdout);
+            continue;
+        }
+
+        int result_pipe[2];
+        if (pipe(result_pipe) != 0)
+        {
+            perror("pipe");
+            fclose(control);
+            return 1;
+        }
+        pid_t pid = fork();
+        if (pid < 0)
+        {
+            perror("fork");
+            close(result_pipe[0]);
+            close(result_pipe[1]);
+            fclose(control);
+            return 1;
+        }
+        if (pid == 0)
+        {
+            close(result_pipe[0]);
+            close(fileno(control));
+            fork_child(vm, limit, input, output, result_pipe[1]);
+        }
+        close(result_pipe[1]);
+
+        struct fork_result result;
+        size_t got = 0;
+        while (got < sizeof(result))
+        {
+            ssize_t n = read(result_pipe[0], (uint8_t *)&result + got, sizeof(result) - got);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            got += n;
+        }
+        close(result_pipe[0]);
+        int status;
+        waitpid(pid, &status, 0);
+
+        if (got == sizeof(result))
+            printf("%s %llu\n", exit_names[result.exit_reason], (unsigned long long)result.instructions);
+        else if (WIFSIGNALED(status))
+            printf("failed signal %d\n", WTERMSIG(status));
+        else if (WIFEXITED(status) && WEXITSTATUS(status) == 2)
+            printf("failed open\n");
+        else
+            printf("failed result\n");
+        fflush(stdout);
+    }
+    fclose(control);
+    return 0;
+}
+
+ int main(int argc, char* const argv[])
+ {
+    uint64_t limit = 0;
+    bool stats = false;
+    const char *serve_path = NULL;
+    bool headless = false;
+    bool redirected = false;
+#ifdef LC3_COUNTERS
+    const char *counters_path = NULL;
+#endif
+    const char *trace_path = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    const char *profile_path = NULL;
+    const char *symbols_path = NULL;
+    uint64_t profile_period = PROFILE_PERIOD_DEFAULT;
+    long profile_hz = 0;
+
+    struct lc3_vm *vm = lc3_vm_create();
+    if (vm == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:b:sHi:o:e:E:t:p:r:S:F:j:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            if (!lc3_vm_set_core(vm, optarg))
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 'n':
+            limit = strtoull(optarg, NULL, 0);
+            break;
+        case 'b':
+            vm->output.size = strtoul(optarg, NULL, 0);
+            if (vm->output.size < 1 || vm->output.size > OUTPUT_BUFFER_MAX)
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 's':
+            stats = true;
+            break;
+        case 'H':
+            headless = true;
+            break;
+        case 'i':
+            headless = true;
+            redirected = true;
+            vm->input.fd = open(optarg, O_RDONLY);
+            if (vm->input.fd < 0)
+            {
+                fprintf(stderr, "cannot open input: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            redirected = true;
+            vm->output.fd = open(optarg, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (vm->output.fd < 0)
+            {
+                fprintf(stderr, "cannot open output: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            record_path = optarg;
+            break;
+        case 'E':
+            replay_path = optarg;
+            break;
+        case 't':
+            trace_path = optarg;
+            break;
+        case 'p':
+            profile_path = optarg;
+            break;
+        case 'r':
+        {
+            char *end;
+            unsigned long long period = strtoull(optarg, &end, 0);
+            if (period == 0 || (*end && strcmp(end, "hz") != 0))
+            {
+                usage(argv[0]);
+                return 2;
+            }
+            if (*end)
+                profile_hz = period;
+            else
+                profile_period = period;
+            break;
+        }
+        case 'S':
+            symbols_path = optarg;
+            break;
+        case 'F':
+            serve_path = optarg;
+            break;
+#ifdef LC3_COUNTERS
+        case 'j':
+            counters_path = optarg;
+            break;
+#endif
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    /* every child of a fork server reads and writes the files of its request */
+    if (serve_path && (redirected || record_path || replay_path || trace_path || profile_path))
+    {
+        usage(argv[0]);
+        return 2;
+    }
+#ifdef LC3_AOT
+    aot_load(vm, vm->core == CORE_AOT);
+#else
+    if (optind >= argc)
+    {
+        usage(argv[0]);
+        return 2;
+    }
+#endif
+    for (int i = optind; i < argc; ++i)
+    {
+        if (!lc3_vm_load(vm, argv[i]))
+        {
+            fprintf(stderr, "failed to load image: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (serve_path)
+        return fork_server(vm, limit, serve_path);
+
+    if (record_path && !lc3_vm_record(vm, record_path))
+    {
+        fprintf(stderr, "cannot write log: %s\n", record_path);
+        return 1;
+    }
+    if (replay_path && !lc3_vm_replay(vm, replay_path))
+    {
+        fprintf(stderr, "cannot replay log: %s\n", replay_path);
+        return 1;
+    }
+
+    int trace_fd = -1;
+    if (trace_path)
+    {
+        trace_fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (trace_fd < 0 || !lc3_vm_trace(vm, trace_fd))
+        {
+            fprintf(stderr, "cannot write trace: %s\n", trace_path);
+            return 1;
+        }
+    }
+
+    const char *image = optind < argc ? argv[argc - 1] : argv[0];
+    if (profile_path && symbols_path && !symbols_load(symbols_path))
+    {
+        fprintf(stderr, "cannot read symbols: %s\n", symbols_path);
+        return 1;
+    }
+    if (profile_path && !symbols_path && optind < argc)
+    {
+        /* the assembler writes x.sym next to x.obj */
+        char path[4096];
+        const char *dot = strrchr(image, '.');
+        int length = dot && !strchr(dot, '/') ? (int)(dot - image) : (int)strlen(image);
+        snprintf(path, sizeof(path), "%.*s.sym", length, image);
+        /* an image without one is profiled by address */
+        if (!symbols_load(path) && errno != ENOENT)
+        {
+            fprintf(stderr, "cannot read symbols: %s\n", path);
+            return 1;
+        }
+    }
+    if (profile_path && profile_hz && !profile_start_timer(vm, profile_hz))
+    {
+        fprintf(stderr, "cannot start the profiling timer\n");
+        return 1;
+    }
+
+    /* a headless guest's keys are not typed, nothing to put back on exit */
+    if (!headless)
+    {
+        interrupt_vm = vm;
+        signal(SIGINT, handle_interrupt);
+        disable_input_buffering();
+    }
+
+    double start = lc3_now_seconds();
+    enum lc3_exit reason = profile_path && !profile_hz ? profile_run(vm, limit, profile_period)
+                         : headless ? lc3_vm_run(vm, limit)
+                         : interruptible_run(vm, limit);
+    double elapsed = lc3_now_seconds() - start;
+    if (profile_hz)
+        profile_stop_timer();
+
+    /* Shutdown */
+    output_flush(vm);
+    if (!headless)
+        restore_input_buffering();
+    bool interrupted = vm->interrupted;
+    if (interrupted)
+        printf("\n");
+    if (reason == LC3_EXIT_ILLEGAL)
+        fprintf(stderr, "illegal opcode at 0x%04x\n", (uint16_t)(vm->reg[R_PC] - 1));
+
+    if (stats)
+    {
+        fprintf(stderr, "core: %s, instructions: %llu, time: %.3f s, %.2f MIPS\n",
+                core_names[vm->core], (unsigned long long)vm->instr_count, elapsed,
+                elapsed > 0 ? vm->instr_count / elapsed / 1e6 : 0.0);
+        if (vm->core == CORE_BLOCK || vm->core == CORE_JIT)
+            print_block_stats(vm);
+#ifdef LC3_HAVE_JIT
+        if (vm->jit_enabled)
+            print_jit_stats(vm);
+#endif
+        print_output_stats(vm);
+        print_input_stats(vm);
+        print_idle_stats(vm, elapsed);
+    }
+#ifdef LC3_COUNTERS
+    if (counters_path)
+    {
+        FILE *file = strcmp(counters_path, "-") == 0 ? stderr : fopen(counters_path, "w");
+        if (file == NULL)
+            fprintf(stderr, "cannot write counters: %s\n", counters_path);
+        else
+        {
+            lc3_vm_dump_counters(vm, file);
+            if (file != stderr)
+                fclose(file);
+        }
+    }
+#endif
+
+    if (profile_path && !profile_write(profile_path, image))
+        fprintf(stderr, "cannot write profile: %s\n", profile_path);
+
+    /* which writes out the rest of the trace */
+    lc3_vm_destroy(vm);
+    if (trace_fd >= 0)
+        close(trace_fd);
+    if (interrupted)
+        return -2;
+    return reason == LC3_EXIT_ILLEGAL ? 1 : 0;
+ }
+#endif
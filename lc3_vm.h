@@ -0,0 +1,508 @@
+#ifndef LC3_VM_H
+#define LC3_VM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+
+/* LC-3 have 10 registers, each size is 16 bit
+  * R0-R7 : general registers
+  * PC : program couter register
+  * COND : the last value written by a flag-setting op, see lc3_flags() */
+ enum {
+     R_R0 = 0,
+     R_R1,
+     R_R2,
+     R_R3,
+     R_R4,
+     R_R5,
+     R_R6,
+     R_R7,
+     R_PC,     /* program counter */
+     R_COND,
+     R_COUNT
+ };
+
+/* LC-3 instruction format 
+  * bit0 bit1 bit2 bit3    |    bit4 bit5 bit6 bit7 bit8 bit9 bit10 bit11 bit12 bit13 bit14 bit15
+  *           opcode                                                                       parameter
+  * LC-3 is RISC */
+ enum {
+     OP_BR = 0,    /* branch */
+     OP_ADD,        /* add */
+     OP_LD,           /* load */
+     OP_ST,           /* store */
+     OP_JSR,        /* jump register */
+     OP_AND,       /* bitwise and */
+     OP_LDR,        /* load register */
+     OP_STR,        /* store register */
+     OP_RTI,         /* unused */
+     OP_NOT,       /* bitwise not */
+     OP_LDI,         /* load indirect */
+     OP_STI,         /* store indirect */
+     OP_JMP,       /* jump */
+     OP_RES,        /* reserved(unused) */
+     OP_LEA,        /* load effective address */
+     OP_TRAP      /* execute trap */
+ };
+
+
+ /* Condition flags register -- condition flag */
+ enum {
+     FL_POS = 1 << 0,    /* positive */
+     FL_ZRO = 1 << 1,    /* zero */
+     FL_NEG = 1 << 2     /* negative */
+ };
+
+
+/* the default program start position : 0x3000*/
+ enum { PC_START = 0x3000 };
+
+ /* trap code */
+ enum {
+     TRAP_GETC = 0x20,      /* get character from keyboard, not echoed onto the terminal */
+     TRAP_OUT = 0x21,        /* output a character */
+     TRAP_PUTS = 0x22,      /* output a word string */
+     TRAP_IN = 0x23,             /* get character from keyboard, echoed onto the terminal */
+     TRAP_PUTSP = 0x24,    /* output a byte string */
+     TRAP_HALT = 0x25         /* halt the program */
+ };
+
+ /* device register */
+ enum {
+     MR_KBSR = 0xFE00,      /* Keyboard status register */
+     MR_KBDR = 0xFE02,      /* Keyboard data register */
+     MR_DSR = 0xFE04,       /* Display status register */
+     MR_DDR = 0xFE06,       /* Display data register */
+     MR_TMR = 0xFE08,       /* Timer status register */
+     MR_TMI = 0xFE0A,       /* Timer interval, in milliseconds */
+     MR_MCR = 0xFFFE        /* Machine control register */
+ };
+
+/* micro-op kinds of the pre-decoded cache, one per handler in run_decoded() */
+enum {
+    UOP_DECODE = 0,     /* not decoded yet, or invalidated by a store */
+    UOP_BR,
+    UOP_ADD,
+    UOP_ADDI,           /* ADD with imm5 */
+    UOP_LD,
+    UOP_ST,
+    UOP_JSR,
+    UOP_JSRR,
+    UOP_AND,
+    UOP_ANDI,           /* AND with imm5 */
+    UOP_LDR,
+    UOP_STR,
+    UOP_NOT,
+    UOP_LDI,
+    UOP_STI,
+    UOP_JMP,
+    UOP_LEA,
+    UOP_TRAP,
+    UOP_ILLEGAL,        /* RTI and the reserved opcode */
+    UOP_LD_DEVICE,      /* LD whose address is a device register, UOP_LD only reads RAM */
+    UOP_ST_DEVICE,      /* ST to a device register, UOP_ST only writes RAM */
+    UOP_COUNT
+};
+
+/* one decoded instruction, PC-relative forms already carry their target */
+struct uop {
+    uint8_t kind;
+    uint8_t r0;         /* DR, SR of a store, or the nzp mask of BR */
+    uint8_t r1;         /* SR1 or BaseR */
+    uint8_t r2;         /* SR2 */
+    uint16_t imm;       /* sign-extended imm5/offset6, or the absolute target address */
+    uint16_t instr;     /* the raw instruction word */
+};
+
+/* longest straight-line run translated into one block */
+enum { BLOCK_MAX_OPS = 32 };
+
+/* memory is mapped in pages of 512 words, each either plain RAM or device
+ * registers; the translators assume devices only live in the last page */
+enum { PAGE_SHIFT = 9, PAGE_COUNT = (UINT16_MAX + 1) >> PAGE_SHIFT };
+enum { PAGE_RAM = 0, PAGE_DEVICE };
+extern uint8_t lc3_page_map[PAGE_COUNT];
+
+/* first address of the device page, devices register within it */
+enum { DEVICE_BASE = MR_KBSR };
+
+/* why lc3_vm_run() returned */
+enum lc3_exit {
+    LC3_EXIT_HALTED = 0,    /* HALT, or a store cleared MCR */
+    LC3_EXIT_QUANTUM,       /* the instructions it was given ran out */
+    LC3_EXIT_INPUT,         /* the guest waits for a key, only with yield_on_input */
+    LC3_EXIT_ILLEGAL,       /* RTI or the reserved opcode, PC points past it */
+    LC3_EXIT_COUNT
+};
+
+enum { OUTPUT_BUFFER_MAX = 1 << 16, OUTPUT_BUFFER_DEFAULT = 4096 };
+enum { INPUT_RING_SIZE = 4096 };    /* a power of two */
+
+/* a trace file of lc3_vm_trace() is TRACE_MAGIC followed by one record per
+ * retired instruction: a tag byte, the PC as the tag says, the instruction
+ * word, the value it left in its destination register with TRACE_VALUE and
+ * the data address it accessed as the tag says. Words are little-endian,
+ * deltas are signed bytes. */
+#define TRACE_MAGIC "LC3T"
+enum {
+    TRACE_PC_NEXT = 0,          /* the PC after the previous record's */
+    TRACE_PC_NEAR = 1,          /* a delta from that follows */
+    TRACE_PC_FAR = 2,           /* the PC follows */
+    TRACE_PC_MASK = 3,
+    TRACE_VALUE = 1 << 2,
+    TRACE_ADDR_NEAR = 1 << 3,   /* a delta from the previous record's address follows */
+    TRACE_ADDR_FAR = 1 << 4,    /* the address follows */
+    TRACE_RECORD_MAX = 9
+};
+enum { TRACE_RING_SIZE = 1 << 22 };     /* a power of two */
+
+/* one reading of the keyboard or timer in a log of lc3_vm_record(), which
+ * is "LC3R" followed by the kind, value and repeat of each one, little-endian */
+struct replay_event {
+    uint8_t kind;
+    uint16_t value;
+    uint32_t repeat;            /* times in a row the guest read this */
+};
+
+struct lc3_vm;
+struct lc3_trace;
+struct block;
+struct aot_block;
+
+/* handlers of a device register; a NULL handler lets the register behave like RAM */
+typedef uint16_t (*device_read_fn)(struct lc3_vm *vm, uint16_t address);
+typedef void (*device_write_fn)(struct lc3_vm *vm, uint16_t address, uint16_t val);
+
+/* everything one guest owns. It is mapped zeroed in one piece, so the
+ * per-word tables only take memory for the pages a guest actually uses, and
+ * memory[] starts on a page boundary for lc3_vm_map_image(). */
+struct lc3_vm {
+    /* 65536 locations, RAM is 64K * 16bit / 2 = 128KB */
+    uint16_t memory[UINT16_MAX + 1];
+    /* R0-R7, PC and COND */
+    uint16_t reg[R_COUNT];
+    bool cond_set;                      /* a flag-setting op ran, see lc3_flags() */
+    /* whether the program is running or not */
+    bool running;
+    uint8_t exit_reason;                /* why running went false, an LC3_EXIT_* */
+    bool yield_on_input;                /* runs return LC3_EXIT_INPUT instead of waiting for a key */
+    /* set by a signal handler of the host: a GETC or IN waiting for a key
+     * then ends the run like yield_on_input, the host stops between runs */
+    volatile sig_atomic_t interrupted;
+    int core;                           /* interpreter core, see lc3_vm_set_core() */
+    bool started;                       /* the first run has set up input, output and the JIT */
+    uint64_t instr_count;               /* instructions retired by the last run */
+    uint64_t store_count;               /* guest stores so far, the idle detector only needs to see it change */
+    struct lc3_trace *trace;            /* set by lc3_vm_trace() */
+
+    /* decoded form of every guest word, filled the first time the word is executed */
+    struct uop uop_cache[UINT16_MAX + 1];
+
+    /* translated blocks by entry PC */
+    struct block *block_cache[UINT16_MAX + 1];
+    /* number of blocks covering each guest word, stores only look further when non-zero */
+    uint8_t block_map[UINT16_MAX + 1];
+    struct block *block_list;
+    struct block *block_graveyard;      /* invalidated, freed once no longer running */
+    struct {
+        uint64_t built;         /* blocks translated */
+        uint64_t invalidated;   /* blocks dropped because a store hit them */
+        uint64_t chained;       /* block transitions through an existing link */
+        uint64_t linked;        /* links created */
+        uint64_t indirect;      /* JMP/RET/JSRR transitions through the dispatcher */
+    } block_stats;
+
+    uint8_t *jit_code;                  /* code buffer, mapped by the first JIT run */
+    size_t jit_size;                    /* starts small, grows when it fills up */
+    size_t jit_used;
+    uint8_t *jit_leave;                 /* exit stub, after the entry stub at jit_code */
+    bool jit_enabled;
+    struct {
+        uint64_t compiled;      /* blocks compiled */
+        uint64_t flushes;       /* times the code buffer filled up */
+        uint64_t linked;        /* native exits patched to jump into their successor */
+        uint64_t runs;          /* entries into native code, chained blocks run on */
+        uint64_t side_exits;    /* native runs that handed an op back to the interpreter */
+    } jit_stats;
+
+    /* set by a store into translated code or one that stopped the machine,
+     * translated blocks return as soon as they see it */
+    bool aot_stale;
+    /* translated blocks of the embedded image by entry PC, cleared when a store hits them */
+    const struct aot_block *aot_table[UINT16_MAX + 1];
+
+    /* handlers of every word of the device page */
+    struct {
+        device_read_fn read;
+        device_write_fn write;
+    } device_slots[UINT16_MAX + 1 - DEVICE_BASE];
+    double timer_due;                   /* TMR reads as ready from then on */
+
+    /* guest output collects here and leaves in one write() per flush, or
+     * with fd -1 is appended to capture, see lc3_vm_capture_output() */
+    struct {
+        int fd;
+        char *capture;
+        size_t captured;
+        size_t capture_size;
+        size_t used;
+        size_t size;            /* flush once this many bytes are pending, 1 writes every byte */
+        bool line_flush;        /* flush on newline, set when fd is a terminal */
+        char buf[OUTPUT_BUFFER_MAX];
+    } output;
+    struct {
+        uint64_t bytes;         /* bytes the guest printed */
+        uint64_t writes;        /* write() calls */
+        uint64_t requests;      /* OUT/PUTS/PUTSP/DDR outputs, each of which used to flush */
+    } output_stats;
+
+    /* keys go from the input fd to the guest through a single-producer/
+     * single-consumer ring; the lock and condition variable are only used
+     * to wait on it */
+    struct {
+        int fd;                 /* -1 when keys come from memory, see lc3_vm_set_input() */
+        const uint8_t *keys;
+        size_t keys_size;
+        size_t keys_taken;      /* of keys, into the ring */
+        bool threaded;          /* a reader thread feeds the ring, otherwise the VM does */
+        pthread_t reader;
+        atomic_size_t head;     /* bytes ever written, only the producer stores it */
+        atomic_size_t tail;     /* bytes ever taken, only the VM stores it */
+        atomic_bool eof;        /* set after the last byte was published */
+        pthread_mutex_t lock;
+        pthread_cond_t ready;   /* signalled by the reader thread after it stored keys */
+        pthread_cond_t space;   /* signalled by the VM when it took a key from a full ring */
+        uint8_t ring[INPUT_RING_SIZE];
+    } input;
+    struct {
+        uint64_t reads;         /* read() calls on input.fd, from either thread */
+    } input_stats;
+
+    struct {
+        uint16_t pc;            /* reg[R_PC] at the first of the current run of polls */
+        uint64_t stores;        /* store_count then */
+        unsigned polls;
+    } idle;
+    struct {
+        uint64_t waits;
+        double seconds;         /* spent blocked in input_wait() */
+    } idle_stats;
+
+#ifdef LC3_COUNTERS
+    /* what the guest executed, see lc3_vm_dump_counters(); only built with
+     * -DLC3_COUNTERS, which a host must then also define */
+    struct {
+        uint64_t ops[16];       /* by instr >> 12 */
+        uint64_t traps[256];    /* by trap vector */
+        uint64_t br_taken;
+        uint64_t br_not_taken;
+        uint64_t device_reads;
+        uint64_t device_writes;
+    } counters;
+#endif
+
+    /* what the guest read from the keyboard and timer, logged by
+     * lc3_vm_record() or fed back by lc3_vm_replay() */
+    struct {
+        uint8_t mode;                   /* REPLAY_OFF, REPLAY_RECORD or REPLAY_PLAY */
+        FILE *file;                     /* the log being recorded */
+        struct replay_event last;       /* recorded but not written, repeats merge into it */
+        struct replay_event *events;    /* the log being played */
+        size_t count;
+        size_t next;                    /* of events, playing */
+        uint32_t used;                  /* of the repeats of events[next] */
+        uint64_t played;                /* readings fed back */
+    } replay;
+
+    /* pages stored to since the snapshot 'dirty_since' was taken or
+     * restored, the only ones lc3_vm_restore() has to copy back from it */
+    uint8_t dirty[PAGE_COUNT];
+    uint64_t dirty_since;
+};
+
+/* an image loaded once for many guests: memory[] of a fresh guest that
+ * loaded it, kept in a memfd that lc3_vm_map_image() maps copy-on-write */
+struct lc3_image {
+    int fd;
+    uint16_t origin;                    /* where the image landed */
+    size_t count;                       /* and how many words */
+};
+
+/* a guest's memory, registers, devices and unread input, see lc3_vm_snapshot() */
+struct lc3_snapshot {
+    uint64_t id;                        /* unique, so a VM knows what its dirty pages are relative to */
+    uint16_t memory[UINT16_MAX + 1];
+    uint16_t reg[R_COUNT];
+    bool cond_set;
+    bool running;
+    uint8_t exit_reason;
+    double timer_left;                  /* seconds until TMR reads ready */
+    /* input the guest has not read yet, only kept when the VM reads its
+     * input itself; a reader thread's pipe or terminal cannot be rewound */
+    bool input_kept;
+    bool input_eof;
+    off_t input_offset;                 /* of input.fd or into input.keys, -1 when it cannot seek */
+    size_t input_pending;
+    uint8_t input_ring[INPUT_RING_SIZE];
+    /* the place in a log of lc3_vm_record() or lc3_vm_replay() */
+    uint8_t replay_mode;
+    long replay_offset;                 /* of the log being recorded */
+    struct replay_event replay_last;    /* recorded but not written yet */
+    size_t replay_next;                 /* of the log being played */
+    uint32_t replay_used;
+    uint64_t replay_played;
+};
+
+/* guests that run one image in lockstep, see lc3_lanes_run(). Each row of
+ * reg[] holds one register of every lane, and the loops over a row compile
+ * to SSE2, two 128-bit registers of LANE_COUNT 16-bit values, on the default
+ * x86-64 build. The rows are aligned for one 256-bit register each, if the
+ * VM is built with -mavx2. */
+enum { LANE_COUNT = 16 };
+
+struct lc3_lanes {
+    _Alignas(32) uint16_t reg[R_COUNT][LANE_COUNT];
+    int count;                          /* lanes in use */
+    uint32_t live;                      /* lanes still running and under the limit */
+    uint32_t waiting;                   /* lanes the last run stopped for input, the next one goes on */
+    uint32_t unflagged;                 /* lanes that ran no flag-setting op yet, see lc3_flags() */
+    uint32_t rewrote_code;              /* lanes that stored over a word some lane executed */
+    uint64_t limit;                     /* instructions per lane, 0 for no limit */
+    uint64_t retired[LANE_COUNT];       /* instructions each lane executed */
+    /* the I/O, devices and running flag of each lane, of its memory only
+     * the device page is used */
+    struct lc3_vm *guest[LANE_COUNT];
+    /* words of each lane by page, shared with base[] until the lane writes */
+    uint16_t *page[LANE_COUNT][PAGE_COUNT];
+    uint16_t base[UINT16_MAX + 1];      /* the image every lane starts from */
+    /* decoded words by PC, a step only uses one if its raw word matches */
+    struct uop uops[UINT16_MAX + 1];
+    struct {
+        uint64_t steps;
+        uint64_t instructions;
+        uint64_t pages_copied;
+    } stats;
+};
+
+/* liblc3vm: a guest reads the process's stdin and writes its stdout unless
+ * input.fd/output.fd are changed before the first run */
+struct lc3_vm *lc3_vm_create(void);
+void lc3_vm_destroy(struct lc3_vm *vm);
+bool lc3_vm_set_core(struct lc3_vm *vm, const char *name);
+bool lc3_vm_load(struct lc3_vm *vm, const char *image_path);
+struct lc3_image *lc3_image_load(const char *image_path);
+void lc3_image_destroy(struct lc3_image *image);
+/* load a shared image into a guest that has not run yet, replacing its
+ * memory; the guest only gets private pages for the ones it stores to
+ * and for the host page holding the device registers. False leaves the
+ * guest as it was. */
+bool lc3_vm_map_image(struct lc3_vm *vm, const struct lc3_image *image);
+/* headless guests: before the first run, make the guest read its keys
+ * from 'size' bytes at 'keys', which must stay there, and then see the end
+ * of input; and keep its output in memory, where lc3_vm_output() finds it */
+bool lc3_vm_set_input(struct lc3_vm *vm, const void *keys, size_t size);
+bool lc3_vm_capture_output(struct lc3_vm *vm);
+const char *lc3_vm_output(struct lc3_vm *vm, size_t *size);
+/* run at most 'limit' instructions (0 means no limit) and tell why it
+ * stopped; instr_count has the number retired. A guest that stopped with
+ * LC3_EXIT_QUANTUM or LC3_EXIT_INPUT resumes with the next run. */
+enum lc3_exit lc3_vm_run(struct lc3_vm *vm, uint64_t limit);
+
+/* log every reading the guest takes from the keyboard (KBSR polls, GETC
+ * and IN) and the timer into 'path', until lc3_vm_destroy(); or feed it
+ * the readings of such a log instead of the devices, without waiting or
+ * system calls, until the log ends or the guest reads something else */
+bool lc3_vm_record(struct lc3_vm *vm, const char *path);
+bool lc3_vm_replay(struct lc3_vm *vm, const char *path);
+
+/* record every instruction the guest retires from now on into a ring that
+ * a thread of its own writes to 'fd', until lc3_vm_destroy(); a traced guest
+ * runs on the switch core */
+bool lc3_vm_trace(struct lc3_vm *vm, int fd);
+
+#ifdef LC3_COUNTERS
+/* write the guest's execution counters to 'file' as one JSON object */
+void lc3_vm_dump_counters(struct lc3_vm *vm, FILE *file);
+#endif
+
+/* capture a guest at the current point, NULL when out of memory or when the
+ * log being recorded cannot seek; a restore brings back its memory,
+ * registers, devices, unread input and place in the log being recorded or
+ * replayed. Pending output is written before the snapshot is taken, and what
+ * the guest prints after it stays printed. Restoring the snapshot taken or
+ * restored last only copies the pages stored to since. */
+struct lc3_snapshot *lc3_vm_snapshot(struct lc3_vm *vm);
+void lc3_vm_restore(struct lc3_vm *vm, const struct lc3_snapshot *snap);
+void lc3_snapshot_destroy(struct lc3_snapshot *snap);
+
+/* 'count' lanes, each with a guest whose input.fd/output.fd can be changed
+ * before the first run */
+struct lc3_lanes *lc3_lanes_create(int count);
+void lc3_lanes_destroy(struct lc3_lanes *lanes);
+bool lc3_lanes_load(struct lc3_lanes *lanes, const char *image_path);
+/* run at most 'steps' steps (0 means until every lane stops), returns the
+ * number of instructions the lanes retired together. With yield_on_input, a
+ * lane that waits for a key stops alone and is listed in 'waiting'. */
+uint64_t lc3_lanes_run(struct lc3_lanes *lanes, uint64_t steps);
+
+bool lc3_device_register(struct lc3_vm *vm, uint16_t first, uint16_t last,
+                         device_read_fn read, device_write_fn write);
+uint16_t lc3_device_read(struct lc3_vm *vm, uint16_t address);
+
+/* what lc3_aot and the code it generates run through the VM: stores, which
+ * drop translations of the word, TRAPs, illegal opcodes and the decoder */
+void lc3_mem_write(struct lc3_vm *vm, uint16_t address, uint16_t val);
+void lc3_op_trap(struct lc3_vm *vm, uint16_t instr);
+void lc3_op_illegal(struct lc3_vm *vm);
+void lc3_uop_decode(struct uop *u, uint16_t pc, uint16_t instr);
+
+/* a monotonic clock in seconds, for hosts that time their guests */
+double lc3_now_seconds(void);
+
+/* basic block of an image translated ahead of time by lc3_aot */
+struct aot_block {
+    uint16_t start;
+    uint16_t count;         /* instructions, at most BLOCK_MAX_OPS */
+    int (*fn)(struct lc3_vm *vm);   /* runs the block, returns the instructions retired */
+};
+
+/* emitted by lc3_aot, aot_blocks ends with an entry whose fn is NULL */
+extern const struct aot_block aot_blocks[];
+extern const uint16_t aot_origin;
+extern const uint16_t aot_image[];
+extern const size_t aot_image_size;
+
+/* N/Z/P of a result. reg[R_COND] holds the last value written by ADD, AND,
+ * NOT, LD, LDI, LDR or LEA, not its flags: callers that read it take the
+ * flags from lc3_flags(vm->reg[R_COND]). Before the first of those ops no
+ * flag is set and no BR branches; vm->cond_set tells the two apart. The
+ * cores take reg[R_COND] for a result, so lc3_vm_run() steps a guest past
+ * that point on its own first, and lanes keep a mask of the unflagged ones.
+ *
+ * Inside a block every register write comes from a flag-setting op, so its
+ * destination still holds the last result at any later exit; translated
+ * blocks only store reg[R_COND] once before each exit. */
+static inline uint16_t lc3_flags(uint16_t value)
+{
+    if (value == 0)
+        return FL_ZRO;
+    return (value >> 15) ? FL_NEG : FL_POS;
+}
+
+static inline bool lc3_is_device(uint16_t address)
+{
+    return lc3_page_map[address >> PAGE_SHIFT] != PAGE_RAM;
+}
+
+/* RAM is read straight from memory[], only device pages take the call */
+static inline uint16_t lc3_mem_read(struct lc3_vm *vm, uint16_t address)
+{
+    return lc3_is_device(address) ? lc3_device_read(vm, address) : vm->memory[address];
+}
+
+#endif
@@ -0,0 +1,174 @@
+/* snapshot: check that lc3_vm_restore() puts a guest back exactly. The
+ * guest maps the image with lc3_vm_map_image(), reads its keys from memory
+ * and captures its output:
+ *
+ *     test/snapshot -c jit test/2048.obj test/2048.keys test/out/2048.switch
+ *
+ * It runs 'count' instructions (-n, default 1000000), takes a snapshot and
+ * plays to the HALT, then restores the snapshot and plays to the HALT again,
+ * twice. Every replay must retire as many instructions, print the same
+ * output and leave the same registers and memory behind, and the output of
+ * the first run must be the expected file.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "lc3_vm.h"
+
+/* far beyond either session, a run that reaches it went wrong */
+enum { GAME_LIMIT = 2000000000 };
+
+/* the whole of 'path' in a malloc()ed buffer, NULL if it cannot be read */
+static char *read_file(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+    char *data = NULL;
+    size_t used = 0;
+    size_t capacity = 0;
+    for (;;)
+    {
+        if (used == capacity)
+        {
+            capacity = capacity ? 2 * capacity : 1 << 16;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL)
+            {
+                free(data);
+                fclose(file);
+                return NULL;
+            }
+            data = grown;
+        }
+        size_t n = fread(data + used, 1, capacity - used, file);
+        used += n;
+        if (n == 0)
+            break;
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    if (failed)
+    {
+        free(data);
+        return NULL;
+    }
+    *size = used;
+    return data;
+}
+
+/* what a run to the HALT left behind */
+struct ending {
+    uint64_t instructions;
+    size_t output_from;     /* where its output starts in lc3_vm_output() */
+    size_t output_to;
+    uint16_t reg[R_COUNT];
+    uint16_t memory[UINT16_MAX + 1];
+};
+
+static bool play_out(struct lc3_vm *vm, struct ending *end)
+{
+    lc3_vm_output(vm, &end->output_from);
+    enum lc3_exit reason = lc3_vm_run(vm, GAME_LIMIT);
+    end->instructions = vm->instr_count;
+    lc3_vm_output(vm, &end->output_to);
+    memcpy(end->reg, vm->reg, sizeof(end->reg));
+    memcpy(end->memory, vm->memory, sizeof(end->memory));
+    return reason == LC3_EXIT_HALTED;
+}
+
+int main(int argc, char *const argv[])
+{
+    const char *core = NULL;
+    uint64_t count = 1000000;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            core = optarg;
+            break;
+        case 'n':
+            count = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c core] [-n count] image keys expected-output\n", argv[0]);
+            return 2;
+        }
+    }
+    if (argc - optind != 3)
+    {
+        fprintf(stderr, "usage: %s [-c core] [-n count] image keys expected-output\n", argv[0]);
+        return 2;
+    }
+    const char *image_path = argv[optind];
+
+    size_t keys_size, expected_size;
+    char *keys = read_file(argv[optind + 1], &keys_size);
+    char *expected = read_file(argv[optind + 2], &expected_size);
+    struct lc3_image *image = lc3_image_load(image_path);
+    struct lc3_vm *vm = lc3_vm_create();
+    struct ending *first = malloc(sizeof(*first));
+    struct ending *again = malloc(sizeof(*again));
+    if (keys == NULL || expected == NULL || image == NULL)
+    {
+        fprintf(stderr, "cannot read %s, %s or %s\n", image_path, argv[optind + 1], argv[optind + 2]);
+        return 1;
+    }
+    if (vm == NULL || first == NULL || again == NULL)
+    {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+    if ((core && !lc3_vm_set_core(vm, core)) || !lc3_vm_map_image(vm, image)
+        || !lc3_vm_set_input(vm, keys, keys_size) || !lc3_vm_capture_output(vm))
+    {
+        fprintf(stderr, "cannot set up the guest of %s\n", image_path);
+        return 1;
+    }
+
+    bool ok = lc3_vm_run(vm, count) == LC3_EXIT_QUANTUM && vm->instr_count == count;
+    struct lc3_snapshot *snap = ok ? lc3_vm_snapshot(vm) : NULL;
+    ok = snap && play_out(vm, first);
+    const char *output = lc3_vm_output(vm, &first->output_to);
+    if (ok && (first->output_to != expected_size || memcmp(output, expected, expected_size) != 0))
+    {
+        fprintf(stderr, "%s: the output is not %s\n", image_path, argv[optind + 2]);
+        ok = false;
+    }
+
+    for (int replay = 1; ok && replay <= 2; ++replay)
+    {
+        lc3_vm_restore(vm, snap);
+        ok = play_out(vm, again);
+        output = lc3_vm_output(vm, &again->output_to);
+        size_t length = first->output_to - first->output_from;
+        if (!ok || again->instructions != first->instructions
+            || again->output_to - again->output_from != length
+            || memcmp(output + again->output_from, output + first->output_from, length) != 0
+            || memcmp(again->reg, first->reg, sizeof(first->reg)) != 0
+            || memcmp(again->memory, first->memory, sizeof(first->memory)) != 0)
+        {
+            fprintf(stderr, "%s: replay %d from the snapshot differs\n", image_path, replay);
+            ok = false;
+        }
+    }
+    if (ok)
+        printf("%s %s restored after %llu of %llu instructions\n", image_path, core ? core : "default",
+               (unsigned long long)count, (unsigned long long)(count + first->instructions));
+
+    if (snap)
+        lc3_snapshot_destroy(snap);
+    lc3_vm_destroy(vm);
+    lc3_image_destroy(image);
+    free(first);
+    free(again);
+    free(keys);
+    free(expected);
+    return ok ? 0 : 1;
+}